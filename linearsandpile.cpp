@@ -5,7 +5,8 @@
 // Copyright   :
 // Description : This program computes a linearized version of a sandpile, modeled
 //				 with tropical curves
-// to compile: g++ -std=c++11 -O3 linearsandpile.cpp -o linearsandpile
+// to compile: g++ -std=c++11 -O3 -pthread linearsandpile.cpp -o linearsandpile
+//              (add -march=native to let the curve rasterization use wider vectors)
 //============================================================================
 
 #include <iostream>
@@ -17,52 +18,362 @@
 #include <set>
 #include <exception>
 #include <random>
+#include <algorithm>
+#include <climits>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <functional>
+#include <limits>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include <cstdio>
+#include <unistd.h>
 
 using namespace std;
 
-//Global variables and macros =================================================
+//Macros ======================================================================
 
 #define CRITICAL 4								// Value at which points become unstable
+#define TILEROWS 16                             // Tile sizes used to rasterize the curve in writeout
+#define TILECOLUMNS 256
+#define BINSPERDECADE 10                        // Log-binned histogram of the avalanche sizes: bins per decade
+#define DECADES 7                               // and number of decades below 1
+#define FITMIN 0.01                             // Range of sizes used to fit the power law
+#define FITMAX 0.99
+//#define INSTRUMENT                            // Or -DINSTRUMENT: counters and timers, written to report.json
 
-int avalanchesize,volume,K;
-map<pair<int, int>, int> current; 				// Map (dictionary) used to store the current (active) monomials as pairs and coefficients
-map<pair<int, int>, set<int> > tocheck;         // map: monomial->unstable points contained in the part where this monomial is the minimal one
-set<int> checkset;                              // indices of unstable points to check
-vector< int> processed;                         // to estimate the size of the avalanche
-vector<pair<int, int> > unstable;		        // Vector used to store the unstable points in the grid
-int m, n;										// Sizes of the grid, m = # of rows; n = # of columns
-pair<int, int> upper, lower, dexter, sinister;	// Current extreme monomials in each direction of the grid (dexter=right, sinister=left in latin)
-int nunstable;									// Number of initial "unstable" cells in the grid
-mt19937 mt;
-uniform_int_distribution<int> dist2, dist1;
-vector<pair<int, int> > curve;                  // tropical curve defined as the set where the min is attained twice
-int curvesize;                                  // number of pixels in the curve
-int touchboundary;                              // is -1 if the avalanche touched the boundary, 1 otherwise
-int seed;
+#ifdef INSTRUMENT
+#define INSTRUMENTED(...) __VA_ARGS__           // The argument is compiled only if INSTRUMENT is defined
+#else
+#define INSTRUMENTED(...)
+#endif
 
 //=============================================================================
 
-pair<int, int> operator+(						// Function to add pairs using the operator +
-    const pair<int, int>& x,
-    const pair<int, int>& y)
+//Number types ================================================================
+// The simulation is a template on the type of the coefficients (and of the
+// values of the polynomial) and on the type of the coordinates of the cells.
+// The coefficients grow like n*m, so int is enough below sides of about 32000
+// and long long is used above; main picks the instantiation from m and n.
+// wider<number> holds the products of two of them exactly.
+//=============================================================================
+
+template <typename number> class wider;
+template <> class wider<int> { public: typedef long long type; };
+template <> class wider<long long> { public: typedef __int128 type; };
+
+bool needswide(int m, int n)                    // Whether a grid needs the 64 bit instantiation
 {
-    return make_pair(x.first + y.first, x.second + y.second);
+    return 2LL * (m + 1) * (n + 1) > INT_MAX;
+}
+
+int segmentexponent(int end, int extreme, int i) // j at i of the segment from (0, end) to (extreme, 0), truncated to
+{                                                // 0. In floats as always, so that a seed keeps its boundary monomials
+    return int(-float(end) / float(extreme) * float(i) + float(end));
+}
+
+long long segmentexponent(long long end, long long extreme, long long i) // Same, exact: floats lose the grids that
+{                                                                         // need the 64 bit instantiation
+    return (long long)((__int128)end * (extreme - i) / extreme);
 }
 
-int ih(pair<int, int> index) 					// Index Helper function to convert from pairs of indices to a single index
+//=============================================================================
+
+//Lower envelope ==============================================================
+// The tropical polynomial min(i*x + j*y + a_ij) is stored split in columns of
+// fixed i. Inside a column it is the lower envelope of the lines j*y + a_ij,
+// kept as a convex hull, so that it can be evaluated at y by a binary search.
+// A query at a cell then costs O(#columns * log(#monomials)) instead of a scan
+// of the whole of current. Columns are rebuilt lazily after they change.
+//=============================================================================
+
+template <typename number>
+class envelopecolumn                            // Lower envelope of the lines j*y + a_ij for a fixed i
 {
-    return index.first * m + index.second;
+    public:
+        map<int, number> lines;                 // j -> a_ij
+        vector<pair<int, number> > hull;        // (j, a_ij) of the lines touching the envelope, by decreasing j
+        bool dirty;                             // hull has to be rebuilt from lines
+        envelopecolumn() : dirty(false) {};
+        void rebuild();
+        number evaluate(number y, int& first, int& last) const; // Minimum at y, attained by hull[first..last]
+};
+
+template <typename number>
+void envelopecolumn<number>::rebuild()
+{
+    typedef typename wider<number>::type product;
+    hull.clear();
+    for (auto c = lines.rbegin(); c != lines.rend(); ++c)
+    {
+        while (hull.size() >= 2)
+        {
+            const pair<int, number>& a = hull[hull.size() - 2];
+            const pair<int, number>& b = hull[hull.size() - 1];
+            // b is dropped only if it is strictly above the intersection of a and c,
+            // lines that touch the envelope at a single point are kept (they can tie)
+            if ((product)(b.second - a.second) * (a.first - c->first) >
+                (product)(a.first - b.first) * (c->second - a.second))
+            {
+                hull.pop_back();
+            }
+            else
+            {
+                break;
+            }
+        }
+        hull.push_back(*c);
+    }
+    dirty = false;
 }
 
-pair<int, int> ih(int index)					// Overload of ih to convert from an index to a pair of indices
+template <typename number>
+number envelopecolumn<number>::evaluate(number y, int& first, int& last) const
 {
-    return make_pair(index / n, index % n);
+    int lo = 0, hi = hull.size() - 1;
+    while (lo < hi)                             // first k with hull[k](y) <= hull[k+1](y)
+    {
+        int mid = (lo + hi) / 2;
+        if (hull[mid].first * y + hull[mid].second <=
+            hull[mid + 1].first * y + hull[mid + 1].second)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+    number result = hull[lo].first * y + hull[lo].second;
+    first = last = lo;
+    while (last + 1 < int(hull.size()) &&
+           hull[last + 1].first * y + hull[last + 1].second == result)
+    {
+        ++last;
+    }
+    return result;
+}
+
+template <typename number, typename coordinate>
+class lowerenvelope                             // Index over the monomials of current for minimum queries
+{
+    private:
+        map<int, envelopecolumn<number> > columns; // i -> column
+    public:
+        INSTRUMENTED(long long scanned = 0;)    // Columns evaluated, plus the lines of the skipped columns
+        void set(const pair<int, int>& monomial, number value);
+        void erase(const pair<int, int>& monomial);
+        number minimum(const pair<coordinate, coordinate>& cell,                   // Minimal value at cell; if argmins is
+                       vector<pair<int, int> >* argmins,                           // not NULL it gets the minimal monomials,
+                       const pair<int, int>* skip = NULL);                         // skip is left out if not NULL
+};
+
+template <typename number, typename coordinate>
+void lowerenvelope<number, coordinate>::set(const pair<int, int>& monomial, number value)
+{
+    envelopecolumn<number>& column = columns[monomial.first];
+    column.lines[monomial.second] = value;
+    column.dirty = true;
+}
+
+template <typename number, typename coordinate>
+void lowerenvelope<number, coordinate>::erase(const pair<int, int>& monomial)
+{
+    auto column = columns.find(monomial.first);
+    if (column == columns.end())
+    {
+        return;
+    }
+    column->second.lines.erase(monomial.second);
+    column->second.dirty = true;
+    if (column->second.lines.empty())
+    {
+        columns.erase(column);
+    }
 }
 
-int minimum(const vector<int>& collection)		// Returns the minimum value in collection
+template <typename number, typename coordinate>
+number lowerenvelope<number, coordinate>::minimum(const pair<coordinate, coordinate>& cell,
+                                                  vector<pair<int, int> >* argmins, const pair<int, int>* skip)
 {
-    int result = *collection.begin();
-    for (vector<int>::const_iterator i = collection.begin(); i < collection.end();
+    number result = 0;
+    int first, last;
+    bool found = false;
+    if (argmins != NULL)
+    {
+        argmins->clear();
+    }
+    for (auto c = columns.begin(); c != columns.end(); ++c)
+    {
+        if (skip != NULL && c->first == skip->first) // Plain scan of the lines, so that the column does not have to
+        {                                            // be changed and rebuilt for the query
+            for (auto l = c->second.lines.begin(); l != c->second.lines.end(); ++l)
+            {
+                if (l->first == skip->second)
+                {
+                    continue;
+                }
+                INSTRUMENTED(++scanned;)
+                number val = number(c->first) * cell.first + number(l->first) * cell.second + l->second;
+                if (!found || val < result)
+                {
+                    result = val;
+                    found = true;
+                    if (argmins != NULL)
+                    {
+                        argmins->clear();
+                    }
+                }
+                if (val == result && argmins != NULL)
+                {
+                    argmins->push_back(make_pair(c->first, l->first));
+                }
+            }
+            continue;
+        }
+        if (c->second.dirty)
+        {
+            c->second.rebuild();
+        }
+        INSTRUMENTED(++scanned;)
+        number val = number(c->first) * cell.first + c->second.evaluate(cell.second, first, last);
+        if (!found || val < result)
+        {
+            result = val;
+            found = true;
+            if (argmins != NULL)
+            {
+                argmins->clear();
+            }
+        }
+        if (val == result && argmins != NULL)
+        {
+            for (int k = last; k >= first; --k) // Increasing j, same order as current
+            {
+                argmins->push_back(make_pair(c->first, c->second.hull[k].first));
+            }
+        }
+    }
+    return result;
+}
+
+//Argmin cache ================================================================
+// Minimal value and minimal monomials of every unstable point. operatorgp only
+// raises one coefficient at a time, and the points having that monomial in
+// their tie set are exactly the ones registered in tocheck for it, which
+// pseudorelax drains anyway. So these points just lose the monomial from their
+// tie set and only the points left without one have to be queried again.
+// The rare changes that can lower a value (new boundary monomials) are logged,
+// and an entry is checked against the changes logged after it when it is read:
+// the points that pseudorelax does not look at again never pay for them.
+//=============================================================================
+
+template <typename number, typename coordinate>
+class argmincache
+{
+    private:
+        vector<number> minvalue;
+        vector<vector<pair<int, int> > > ties;  // Sorted as in current
+        vector<bool> valid;
+        vector<int> seen;                       // Changes of lowered already checked against the entry
+        vector<pair<pair<int, int>, number> > lowered; // Monomials that appeared or went down, with their new values
+    public:
+        void resize(int points);
+        bool get(int pointnumber, const pair<coordinate, coordinate>& point, // point are the coordinates of the point
+                 vector<pair<int, int> >& result);
+        void store(int pointnumber, number value, const vector<pair<int, int> >& monomials);
+        void raise(int pointnumber, const pair<int, int>& monomial); // monomial is going up, it leaves the tie set
+        void lower(const pair<int, int>& monomial, number value);    // monomial appeared or went down to value
+        void clear();
+};
+
+template <typename number, typename coordinate>
+void argmincache<number, coordinate>::resize(int points)
+{
+    minvalue.resize(points, 0);
+    ties.resize(points);
+    for (unsigned int i = 0; i < ties.size(); ++i)
+    {
+        ties[i].reserve(8);                     // Larger tie sets are very rare
+    }
+    valid.resize(points, false);
+    seen.resize(points, 0);
+}
+
+template <typename number, typename coordinate>
+bool argmincache<number, coordinate>::get(int pointnumber, const pair<coordinate, coordinate>& point,
+                                          vector<pair<int, int> >& result)
+{
+    for (unsigned int k = seen[pointnumber]; k < lowered.size() && valid[pointnumber]; ++k)
+    {
+        const pair<int, int>& monomial = lowered[k].first;
+        if (number(monomial.first) * point.first + number(monomial.second) * point.second + lowered[k].second <=
+            minvalue[pointnumber])
+        {
+            valid[pointnumber] = false;
+        }
+    }
+    seen[pointnumber] = lowered.size();
+    if (valid[pointnumber])
+    {
+        result = ties[pointnumber];
+    }
+    return valid[pointnumber];
+}
+
+template <typename number, typename coordinate>
+void argmincache<number, coordinate>::store(int pointnumber, number value, const vector<pair<int, int> >& monomials)
+{
+    minvalue[pointnumber] = value;
+    ties[pointnumber] = monomials;
+    valid[pointnumber] = true;
+    seen[pointnumber] = lowered.size();
+}
+
+template <typename number, typename coordinate>
+void argmincache<number, coordinate>::raise(int pointnumber, const pair<int, int>& monomial)
+{
+    if (valid[pointnumber])
+    {
+        vector<pair<int, int> >& t = ties[pointnumber];
+        auto i = find(t.begin(), t.end(), monomial);
+        if (i != t.end())
+        {
+            t.erase(i);
+        }
+        if (t.empty())
+        {
+            valid[pointnumber] = false;
+        }
+    }
+}
+
+template <typename number, typename coordinate>
+void argmincache<number, coordinate>::lower(const pair<int, int>& monomial, number value)
+{
+    lowered.push_back(make_pair(monomial, value));
+}
+
+template <typename number, typename coordinate>
+void argmincache<number, coordinate>::clear()
+{
+    fill(valid.begin(), valid.end(), false);
+}
+
+pair<int, int> operator+(						// Function to add pairs using the operator +
+    const pair<int, int>& x,
+    const pair<int, int>& y)
+{
+    return make_pair(x.first + y.first, x.second + y.second);
+}
+
+template <typename number>
+number minimum(const vector<number>& collection)		// Returns the minimum value in collection
+{
+    number result = *collection.begin();
+    for (auto i = collection.begin(); i < collection.end();
             ++i)
     {
         if (*i < result)
@@ -73,253 +384,1069 @@ int minimum(const vector<int>& collection)		// Returns the minimum value in coll
     return result;
 }
 
-int coefficient(const pair<int, int>& element)  // initial coefficient of the monomial (element.first,element.second)
+//Curve rasterization =========================================================
+// The curve is the set of cells where the minimum is attained at least twice.
+// The cells are processed in tiles of TILEROWS x TILECOLUMNS; for each tile only
+// the monomials that can reach the minimum somewhere in it are kept (a linear
+// function is extremal at the corners), and then every row of the tile is
+// swept with the two smallest values per cell kept in plain int arrays, a loop
+// the compiler turns into vector min/max instructions. Bands of TILEROWS rows
+// are handed out to nthreads threads and joined back in the original order.
+//=============================================================================
+
+template <typename number>
+class monomialarrays                            // current copied as a structure of arrays
+{
+    public:
+        vector<int> expi, expj;
+        vector<number> coef;
+        monomialarrays(const map<pair<int, int>, number>& polynomial);
+};
+
+template <typename number>
+monomialarrays<number>::monomialarrays(const map<pair<int, int>, number>& polynomial)
+{
+    for (auto i = polynomial.begin(); i != polynomial.end(); ++i)
+    {
+        expi.push_back(i->first.first);
+        expj.push_back(i->first.second);
+        coef.push_back(i->second);
+    }
+}
+
+template <typename number>
+void rasterizetile(const monomialarrays<number>& p, int x0, int x1, int y0, int y1, vector<int>& candidates,
+                   char* flags, int stride)     // flags[(x - x0) * stride + y] is set if (x,y) is on the curve
+{
+    number lowest[TILECOLUMNS], second[TILECOLUMNS];
+    int columns = y1 - y0;
+    number bound = numeric_limits<number>::max();
+    for (unsigned int k = 0; k < p.coef.size(); ++k) // Upper bound of the polynomial on the tile
+    {
+        number a = number(p.expi[k]) * x0 + number(p.expj[k]) * y0 + p.coef[k];
+        number di = number(p.expi[k]) * (x1 - 1 - x0), dj = number(p.expj[k]) * (y1 - 1 - y0);
+        bound = min(bound, a + max(di, number(0)) + max(dj, number(0)));
+    }
+    candidates.clear();
+    for (unsigned int k = 0; k < p.coef.size(); ++k)
+    {
+        number a = number(p.expi[k]) * x0 + number(p.expj[k]) * y0 + p.coef[k];
+        number di = number(p.expi[k]) * (x1 - 1 - x0), dj = number(p.expj[k]) * (y1 - 1 - y0);
+        if (a + min(di, number(0)) + min(dj, number(0)) <= bound)
+        {
+            candidates.push_back(k);
+        }
+    }
+    for (int x = x0; x < x1; ++x)
+    {
+        fill(lowest, lowest + columns, numeric_limits<number>::max());
+        fill(second, second + columns, numeric_limits<number>::max());
+        for (unsigned int c = 0; c < candidates.size(); ++c)
+        {
+            int k = candidates[c];
+            number base = number(p.expi[k]) * x + number(p.expj[k]) * y0 + p.coef[k];
+            number step = p.expj[k];
+            for (int t = 0; t < columns; ++t)
+            {
+                number val = base + step * t;
+                second[t] = min(second[t], max(lowest[t], val));
+                lowest[t] = min(lowest[t], val);
+            }
+        }
+        char* row = flags + (x - x0) * stride + y0;
+        for (int t = 0; t < columns; ++t)
+        {
+            row[t] = (lowest[t] == second[t]);
+        }
+    }
+}
+
+//Dual subdivision ============================================================
+// The tropical curve is dual to the subdivision of the Newton polygon induced
+// by the coefficients: its cells are the projections of the lower faces of the
+// convex hull of the points (i, j, a_ij). Every cell gives a vertex of the
+// curve, every edge between two cells a bounded edge of the curve, and every
+// edge on the border of the Newton polygon an unbounded ray; the weights are
+// the lattice lengths of the dual edges. The hull is built with the randomized
+// incremental algorithm with conflict lists, expected O(N log N) for N
+// monomials, and all predicates are exact integer arithmetic.
+//=============================================================================
+
+class hullface
+{
+    public:
+        int v[3];                               // Vertices, counterclockwise seen from outside
+        int neighbor[3];                        // neighbor[k] is the face across the edge v[k] -> v[k+1]
+        long long nx, ny, nz;                   // Outward normal (v[1]-v[0]) x (v[2]-v[0])
+        bool alive;
+        vector<int> conflicts;                  // Points not inserted yet that see the face
+};
+
+class convexhull                                // Convex hull of points of Z^3
+{
+    public:
+        vector<long long> x, y, z;              // The points, in insertion order
+        vector<hullface> faces;                 // Only the faces with alive == true are on the hull
+        bool flat;                              // All the points are coplanar, faces is empty
+        convexhull(vector<long long> px, vector<long long> py, vector<long long> pz);
+        __int128 side(int f, int p) const;      // > 0 if point p is strictly outside the plane of face f
+    private:
+        vector<vector<int> > pointconflicts;    // Faces seen by each point not inserted yet
+        vector<int> visible, startof, seen;     // Stamps used by insert
+        int addface(int a, int b, int c);
+        void addconflict(int f, int p);
+        void insert(int p);
+};
+
+__int128 convexhull::side(int f, int p) const
+{
+    const hullface& face = faces[f];
+    return (__int128)face.nx * (x[p] - x[face.v[0]]) +
+           (__int128)face.ny * (y[p] - y[face.v[0]]) +
+           (__int128)face.nz * (z[p] - z[face.v[0]]);
+}
+
+int convexhull::addface(int a, int b, int c)
+{
+    hullface face;
+    face.v[0] = a;
+    face.v[1] = b;
+    face.v[2] = c;
+    face.neighbor[0] = face.neighbor[1] = face.neighbor[2] = -1;
+    long long ux = x[b] - x[a], uy = y[b] - y[a], uz = z[b] - z[a];
+    long long wx = x[c] - x[a], wy = y[c] - y[a], wz = z[c] - z[a];
+    face.nx = uy * wz - uz * wy;
+    face.ny = uz * wx - ux * wz;
+    face.nz = ux * wy - uy * wx;
+    face.alive = true;
+    faces.push_back(face);
+    visible.push_back(-1);
+    return faces.size() - 1;
+}
+
+void convexhull::addconflict(int f, int p)
+{
+    faces[f].conflicts.push_back(p);
+    pointconflicts[p].push_back(f);
+}
+
+convexhull::convexhull(vector<long long> px, vector<long long> py, vector<long long> pz)
+{
+    int count = px.size();
+    vector<int> order(count);
+    for (int i = 0; i < count; ++i)
+    {
+        order[i] = i;
+    }
+    mt19937 shuffler(count);                    // Own generator, so that the simulation's mt is not touched
+    shuffle(order.begin(), order.end(), shuffler);
+    for (int i = 0; i < count; ++i)
+    {
+        x.push_back(px[order[i]]);
+        y.push_back(py[order[i]]);
+        z.push_back(pz[order[i]]);
+    }
+    flat = true;
+    // Initial tetrahedron: move four affinely independent points to the front
+    int found = 1;
+    for (int i = 1; i < count && found < 4; ++i)
+    {
+        bool independent;
+        long long ux = x[i] - x[0], uy = y[i] - y[0], uz = z[i] - z[0];
+        if (found == 1)
+        {
+            independent = (ux != 0 || uy != 0 || uz != 0);
+        }
+        else
+        {
+            long long vx = x[1] - x[0], vy = y[1] - y[0], vz = z[1] - z[0];
+            long long cx = vy * uz - vz * uy, cy = vz * ux - vx * uz, cz = vx * uy - vy * ux;
+            if (found == 2)
+            {
+                independent = (cx != 0 || cy != 0 || cz != 0);
+            }
+            else
+            {
+                long long wx = x[2] - x[0], wy = y[2] - y[0], wz = z[2] - z[0];
+                independent = ((__int128)cx * wx + (__int128)cy * wy + (__int128)cz * wz != 0);
+            }
+        }
+        if (independent)
+        {
+            swap(x[i], x[found]);
+            swap(y[i], y[found]);
+            swap(z[i], z[found]);
+            ++found;
+        }
+    }
+    if (found < 4)
+    {
+        return;
+    }
+    flat = false;
+    pointconflicts.resize(count);
+    startof.resize(count, -1);
+    seen.resize(count, -1);
+    int f = addface(0, 1, 2);
+    if (side(f, 3) > 0)                         // Point 3 has to be inside
+    {
+        faces.clear();
+        visible.clear();
+        addface(0, 2, 1);
+        addface(0, 1, 3);
+        addface(1, 2, 3);
+        addface(2, 0, 3);
+    }
+    else
+    {
+        addface(0, 3, 1);
+        addface(1, 3, 2);
+        addface(2, 3, 0);
+    }
+    for (int a = 0; a < 4; ++a)                 // Glue the four faces together
+    {
+        for (int b = 0; b < 4; ++b)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                for (int l = 0; l < 3; ++l)
+                {
+                    if (faces[a].v[k] == faces[b].v[(l + 1) % 3] && faces[a].v[(k + 1) % 3] == faces[b].v[l])
+                    {
+                        faces[a].neighbor[k] = b;
+                    }
+                }
+            }
+        }
+    }
+    for (int p = 4; p < count; ++p)
+    {
+        for (int g = 0; g < 4; ++g)
+        {
+            if (side(g, p) > 0)
+            {
+                addconflict(g, p);
+            }
+        }
+    }
+    for (int p = 4; p < count; ++p)
+    {
+        insert(p);
+    }
+}
+
+void convexhull::insert(int p)
+{
+    vector<int> seenfaces;
+    for (unsigned int i = 0; i < pointconflicts[p].size(); ++i)
+    {
+        int f = pointconflicts[p][i];
+        if (faces[f].alive)
+        {
+            seenfaces.push_back(f);
+            visible[f] = p;
+        }
+    }
+    pointconflicts[p].clear();
+    if (seenfaces.empty())                      // Inside the hull (or on its border)
+    {
+        return;
+    }
+    vector<int> created;
+    for (unsigned int i = 0; i < seenfaces.size(); ++i)
+    {
+        int f = seenfaces[i];
+        for (int k = 0; k < 3; ++k)
+        {
+            int g = faces[f].neighbor[k];
+            if (visible[g] == p)
+            {
+                continue;
+            }
+            // (u, w) is on the horizon: the new face (u, w, p) replaces f along it
+            int u = faces[f].v[k], w = faces[f].v[(k + 1) % 3];
+            int h = addface(u, w, p);
+            faces[h].neighbor[0] = g;
+            for (int l = 0; l < 3; ++l)
+            {
+                if (faces[g].v[l] == w && faces[g].v[(l + 1) % 3] == u)
+                {
+                    faces[g].neighbor[l] = h;
+                }
+            }
+            startof[u] = h;
+            const vector<int>* candidates[2] = {&faces[f].conflicts, &faces[g].conflicts};
+            for (int c = 0; c < 2; ++c)
+            {
+                for (unsigned int q = 0; q < candidates[c]->size(); ++q)
+                {
+                    int r = (*candidates[c])[q];
+                    if (r > p && seen[r] != h)
+                    {
+                        seen[r] = h;
+                        if (side(h, r) > 0)
+                        {
+                            addconflict(h, r);
+                        }
+                    }
+                }
+            }
+            created.push_back(h);
+        }
+    }
+    for (unsigned int i = 0; i < created.size(); ++i) // The horizon is a cycle: glue consecutive new faces
+    {
+        int h = created[i];
+        int next = startof[faces[h].v[1]];
+        faces[h].neighbor[1] = next;
+        faces[next].neighbor[2] = h;
+    }
+    for (unsigned int i = 0; i < seenfaces.size(); ++i)
+    {
+        faces[seenfaces[i]].alive = false;
+        vector<int>().swap(faces[seenfaces[i]].conflicts);
+    }
+}
+
+long long gcd(long long a, long long b)
 {
-    int temp1[] =
+    a = llabs(a);
+    b = llabs(b);
+    while (b != 0)
     {
-        element.first * 0 + element.second * 0,
-        element.first * n + element.second * 0,
-        element.first * 0 + element.second * m,
-        element.first * n + element.second * m
+        long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+int findcell(vector<int>& parent, int f)        // Union-find over the lower faces
+{
+    while (parent[f] != f)
+    {
+        parent[f] = parent[parent[f]];
+        f = parent[f];
+    }
+    return f;
+}
+
+//Avalanche statistics ========================================================
+// Every avalanche is appended to a binary file as an avalancherecord, and the
+// sizes of the avalanches that did not touch the boundary (normalized by the
+// number of points, as in power...txt) go to a powerlawfit. It keeps a
+// log-binned histogram and the sums needed for the maximum likelihood exponent
+// of the density C*s^(-alpha) on [FITMIN, FITMAX]: with N sizes in the range
+// and L the sum of their logs, alpha maximizes -alpha*L - N*log(Z(alpha)),
+// where Z(alpha) is the integral of s^(-alpha) over the range.
+//=============================================================================
+
+template <typename number>
+class avalancherecord                           // One avalanche in the binary file, 32 bit ints but the coefficients
+{
+    public:
+        int points;                             // Number of points dropped so far (K)
+        int size;                               // Number of points that toppled
+        int volume;                             // Number of topplings
+        int boundary;                           // -1 if the avalanche touched the boundary, 1 otherwise
+        number a00, a10, a01, a11;              // Coefficients after the avalanche
+        int degree;
+};
+
+class powerlawfit
+{
+    public:
+        vector<long long> counts;               // counts[k]: sizes in [10^((k-1)/BINSPERDECADE-DECADES), 10^(k/BINSPERDECADE-DECADES)),
+        long long total;                        // counts[0] gets everything below 10^-DECADES
+        long long infit;                        // Number of sizes in [FITMIN, FITMAX]
+        double sumlog;                          // and sum of their logs
+        powerlawfit() : counts(BINSPERDECADE * DECADES + 1, 0), total(0), infit(0), sumlog(0) {};
+        void add(double size);
+        void merge(const powerlawfit& other);
+        double loglikelihood(double alpha) const; // Divided by infit
+        double exponent(double& error) const;   // Maximum likelihood alpha, error is its standard error
+        void write(const string& path) const;   // The histogram as text: lower end, upper end, count, density
+        void report(ostream& output) const;
+};
+
+void powerlawfit::add(double size)
+{
+    int k = int(floor((log10(size) + DECADES) * BINSPERDECADE)) + 1;
+    k = max(0, min(k, int(counts.size()) - 1));
+    ++counts[k];
+    ++total;
+    if (size >= FITMIN && size <= FITMAX)
+    {
+        ++infit;
+        sumlog += log(size);
+    }
+}
+
+void powerlawfit::merge(const powerlawfit& other)
+{
+    for (unsigned int k = 0; k < counts.size(); ++k)
+    {
+        counts[k] += other.counts[k];
+    }
+    total += other.total;
+    infit += other.infit;
+    sumlog += other.sumlog;
+}
+
+double powerlawfit::loglikelihood(double alpha) const
+{
+    double a = log(FITMIN), b = log(FITMAX), t = 1 - alpha, z;
+    if (fabs(t) < 1e-9)
+    {
+        z = b - a;
+    }
+    else
+    {
+        z = (exp(t * b) - exp(t * a)) / t;
+    }
+    return -alpha * sumlog / infit - log(z);
+}
+
+double powerlawfit::exponent(double& error) const
+{
+    double lo = -10, hi = 10, h = 1e-3;
+    error = 0;
+    if (infit == 0)
+    {
+        return 0;
+    }
+    const double r = (sqrt(5.0) - 1) / 2;       // Golden section search, the log-likelihood is concave
+    double x1 = hi - r * (hi - lo), x2 = lo + r * (hi - lo);
+    double f1 = loglikelihood(x1), f2 = loglikelihood(x2);
+    for (int i = 0; i < 100; ++i)
+    {
+        if (f1 < f2)
+        {
+            lo = x1;
+            x1 = x2;
+            f1 = f2;
+            x2 = lo + r * (hi - lo);
+            f2 = loglikelihood(x2);
+        }
+        else
+        {
+            hi = x2;
+            x2 = x1;
+            f2 = f1;
+            x1 = hi - r * (hi - lo);
+            f1 = loglikelihood(x1);
+        }
+    }
+    double alpha = (lo + hi) / 2;
+    double second = (loglikelihood(alpha + h) - 2 * loglikelihood(alpha) + loglikelihood(alpha - h)) / (h * h);
+    if (second < 0)
+    {
+        error = 1 / sqrt(-second * infit);
+    }
+    return alpha;
+}
+
+void powerlawfit::write(const string& path) const
+{
+    ofstream output(path.c_str(), ios::out );
+    for (unsigned int k = 0; k < counts.size(); ++k)
+    {
+        double lower = k == 0 ? 0 : pow(10.0, double(k - 1) / BINSPERDECADE - DECADES);
+        double upper = pow(10.0, double(k) / BINSPERDECADE - DECADES);
+        output << lower << " " << upper << " " << counts[k] << " " <<
+                  (total == 0 ? 0 : counts[k] / (total * (upper - lower))) << "\n";
+    }
+    output.close();
+}
+
+void powerlawfit::report(ostream& output) const
+{
+    double error, alpha = exponent(error);
+    output << "avalanches inside the boundary: " << total << ", in [" << FITMIN << ", " << FITMAX << "]: " << infit <<
+              endl << "power law exponent: " << alpha << " +- " << error << endl;
+}
+
+//Instrumentation =============================================================
+// With INSTRUMENT defined, every tropicalsandpile counts what its hot paths
+// do and times the phases of the run, and writeout puts it all in
+// tsandpile/report<suffix>.json. Without it the INSTRUMENTED statements and
+// the runstats member are not compiled at all.
+//=============================================================================
+
+#ifdef INSTRUMENT
+class runstats
+{
+    public:
+        long long minimalmonomialscalls;        // Queries of the minimal monomials of a point
+        long long cachehits;                    // of which answered by argmins
+        long long operatorgpcalls;
+        long long boundaryexpansions;           // operatorgp calls that moved the boundary monomials
+        long long checkpeak;                    // Largest number of points waiting in checkheap
+        long long drains;                       // Lists of tocheck emptied by pseudorelax
+        long long fanout;                       // Points in them, all together
+        long long fanoutmax;                    // and in the longest one
+        double simulation, finalcheck, writeout; // Wall time in seconds
+        runstats() : minimalmonomialscalls(0), cachehits(0), operatorgpcalls(0), boundaryexpansions(0), checkpeak(0),
+                     drains(0), fanout(0), fanoutmax(0), simulation(0), finalcheck(0), writeout(0) {};
+};
+
+double secondssince(const chrono::steady_clock::time_point& start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+#endif
+
+//Simulation ==================================================================
+// All the state of one run lives in a tropicalsandpile, so that several seeds
+// can be simulated at the same time in one process (see --ensemble in main).
+//=============================================================================
+
+class checknode                                 // Element of the lists of points in tocheck
+{
+    public:
+        int point;
+        int next;                               // Next node of the list, -1 at the end
+        int monomial;                           // id of the list
+        int pointnext;                          // Next node of the same point, in the list of another monomial
+};
+
+template <typename number, typename coordinate>
+class tropicalsandpile
+{
+    private:
+        int avalanchesize,volume,K;
+        map<pair<int, int>, number> current; 				// Map (dictionary) used to store the current (active) monomials as pairs and coefficients
+        map<pair<int, int>, int> monomialid;            // monomial -> index in tocheck, given when the monomial enters current
+        vector<int> tocheck;                            // monomial id -> first node of the list of unstable points contained in the part where this monomial is the minimal one, -1 if empty
+        vector<checknode> checknodes;                   // pool of the nodes of all the lists of tocheck
+        int freenode;                                   // first node of the free list in checknodes, -1 if empty
+        vector<int> pointnodes;                         // point -> first of its nodes in checknodes, -1 if it is in no list
+        vector<int> checkheap;                          // indices of unstable points to check, min-heap so the smallest goes first
+        vector<bool> queued;                            // whether a point is in checkheap
+        vector<int> processed;                          // to estimate the size of the avalanche: epoch of the last avalanche that toppled the point
+        int epoch;                                      // number of the current avalanche
+        vector<pair<int, int> > ties, newmon;           // scratch space of pseudorelax and operatorgp
+        vector<pair<coordinate, coordinate> > unstable;	// Vector used to store the unstable points in the grid
+        pair<int, int> upper, lower, dexter, sinister;	// Current extreme monomials in each direction of the grid (dexter=right, sinister=left in latin)
+        mt19937 mt;
+        uniform_int_distribution<coordinate> dist2, dist1;
+        vector<pair<int, int> > curve;                  // tropical curve defined as the set where the min is attained twice
+        int curvesize;                                  // number of pixels in the curve
+        int touchboundary;                              // is -1 if the avalanche touched the boundary, 1 otherwise
+        lowerenvelope<number, coordinate> envelope;     // Same monomials as current, used for all minimum queries
+        argmincache<number, coordinate> argmins;        // Cached minimal monomials of the points in unstable
+        coordinate ih(pair<coordinate, coordinate> index) const;
+        pair<coordinate, coordinate> ih(coordinate index) const;
+        number coefficient(const pair<int, int>& element) const;
+        vector<pair<int, int> > minimalmonomials(const pair<coordinate, coordinate>& cell);
+        bool minimalmonomials(int pointnumber, vector<pair<int, int> >& result);
+        void setcoefficient(const pair<int, int>& monomial, number value);
+        coordinate boundaryexponent(coordinate end, coordinate extreme, coordinate i) const;
+        void add(pair<int, int> monomial);
+        void operatorgp(const pair<int, int>& monomial, int pointnumber);
+        void enqueue(int pointnumber);
+        void registerpoint(int pointnumber, const vector<pair<int, int> >& monomials);
+        void unlinkpoint(int node);
+        void pseudorelax();
+        void savecheckpoint(const vector<long long>& offsets);
+        bool loadcheckpoint(vector<long long>& offsets);
+        void rasterizecurve(vector<pair<int, int> >& result);
+        void writecurve(const string& path);
+    public:
+        int m, n;										// Sizes of the grid, m = # of rows; n = # of columns
+        int nunstable;									// Number of initial "unstable" cells in the grid
+        int seed;
+        int nthreads;                                   // Threads used by writeout
+        bool rasterize;                                 // Whether writeout puts the curve pixels in grid.dat
+        string suffix;                                  // Appended to the names of grid.dat, active.dat and curve.dat
+        bool text;                                      // Whether run also writes the power...txt text files
+        int checkpoint;                                 // run saves the state every checkpoint avalanches, 0 for never
+        bool resume;                                    // Whether run starts from the last checkpoint, if there is one
+        vector<float> sizes, volumes;                   // What goes to power...txt and ...w.txt, one entry per experiment
+        powerlawfit fit;                                // Sizes of the avalanches that did not touch the boundary
+        INSTRUMENTED(runstats stats;)
+        tropicalsandpile(int rows, int columns, int points, int s);
+        void run();                                     // All the experiments, writes the power... files
+        string powername() const;                       // ./tsandpile/power<n>_<nunstable>_<seed>
+        void writeout();
+        INSTRUMENTED(void writereport(const string& path) const;)
+};
+
+template <typename number, typename coordinate>
+coordinate tropicalsandpile<number, coordinate>::ih(pair<coordinate, coordinate> index) const // Index Helper function to convert from pairs of indices to a single index
+{
+    return index.first * m + index.second;
+}
+
+template <typename number, typename coordinate>
+pair<coordinate, coordinate> tropicalsandpile<number, coordinate>::ih(coordinate index) const // Overload of ih to convert from an index to a pair of indices
+{
+    return make_pair(index / n, index % n);
+}
+
+template <typename number, typename coordinate>
+number tropicalsandpile<number, coordinate>::coefficient(const pair<int, int>& element) const // initial coefficient of the monomial (element.first,element.second)
+{
+    number temp1[] =
+    {
+        number(element.first) * 0 + number(element.second) * 0,
+        number(element.first) * n + number(element.second) * 0,
+        number(element.first) * 0 + number(element.second) * m,
+        number(element.first) * n + number(element.second) * m
     };
-    vector<int> temp2(temp1, temp1 + sizeof(temp1) / sizeof(int));
+    vector<number> temp2(temp1, temp1 + sizeof(temp1) / sizeof(number));
     return -minimum(temp2);
 }
 
-vector<pair<int, int> > minimalmonomials(const pair<int, int>& cell) // The minimal polynomial at cell
+template <typename number, typename coordinate>
+vector<pair<int, int> > tropicalsandpile<number, coordinate>::minimalmonomials(const pair<coordinate, coordinate>& cell) // The minimal polynomial at cell
 {
-    vector<int> temp1;
-    map<pair<int, int>, int>::iterator i;
-    vector<pair<int, int> > result;
-    
-    for (i = current.begin(); i != current.end(); ++i)
+    vector<pair<int, int> > result;
+    envelope.minimum(cell, &result);
+    return result;
+}
+
+template <typename number, typename coordinate>
+bool tropicalsandpile<number, coordinate>::minimalmonomials(int pointnumber, vector<pair<int, int> >& result) // Overload for unstable[pointnumber],
+{                                                                                          // goes through argmins, true
+    INSTRUMENTED(++stats.minimalmonomialscalls;)                                           // if the cache had it
+    if (argmins.get(pointnumber, unstable[pointnumber], result))
+    {
+        INSTRUMENTED(++stats.cachehits;)
+        return true;
+    }
+    argmins.store(pointnumber, envelope.minimum(unstable[pointnumber], &result), result);
+    return false;
+}
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::setcoefficient(const pair<int, int>& monomial, number value) // Changes of current go through
+{                                                                                 // here, so that envelope and
+                                                                                  // argmins stay in sync
+    auto old = current.find(monomial);
+    if (old == current.end())
+    {
+        monomialid[monomial] = tocheck.size();
+        tocheck.push_back(-1);
+    }
+    if (old == current.end() || value < old->second)
     {
-        temp1.push_back(i->first.first * cell.first +
-                        i->first.second * cell.second +
-                        i->second);
+        argmins.lower(monomial, value);
     }
-    int m = minimum(temp1);
-    for (i = current.begin(); i != current.end(); ++i)
+    else if (value > old->second)
     {
-        int val = i->first.first * cell.first +
-                  i->first.second * cell.second +
-                  i->second;
-        if (val == m)
+        for (int node = tocheck[monomialid[monomial]]; node != -1; node = checknodes[node].next)
         {
-            result.push_back(i->first);
+            argmins.raise(checknodes[node].point, monomial); // The points with monomial in their tie set
         }
     }
-    return result;
+    current[monomial] = value;
+    envelope.set(monomial, value);
 }
-
-void add(pair<int, int> monomial)
-{
-    if (current.find(monomial) == current.end())
-    {
-        current[monomial] = coefficient(monomial);
-    }
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::add(pair<int, int> monomial)
+{
+    if (current.find(monomial) == current.end())
+    {
+        setcoefficient(monomial, coefficient(monomial));
+    }
 }
-void operatorgp(const pair<int, int>& monomial, int pointnumber)
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::operatorgp(const pair<int, int>& monomial, int pointnumber)
 {
     bool flag = false;
-    pair<int, int> temp1;
-    vector<int> temp3;
-    int temp2;
+    pair<coordinate, coordinate> temp1;
+    number temp2;
     if (monomial == upper)
     {
         upper = monomial + make_pair(0, 1);
-        current[upper] = coefficient(upper);
+        setcoefficient(upper, coefficient(upper));
         flag = true;
     }
     if (monomial == lower)
     {
         lower = monomial + make_pair(0, -1);
-        current[lower] = coefficient(lower);
+        setcoefficient(lower, coefficient(lower));
         flag = true;
     }
     if (monomial == sinister)
     {
         sinister = monomial + make_pair(-1, 0);
-        current[sinister] = coefficient(sinister);
+        setcoefficient(sinister, coefficient(sinister));
         flag = true;
     }
     if (monomial == dexter)
     {
         dexter = monomial + make_pair(1, 0);
-        current[dexter] = coefficient(dexter);
+        setcoefficient(dexter, coefficient(dexter));
         flag = true;
     }
+    INSTRUMENTED(++stats.operatorgpcalls;)
     if (flag == true)
     {
+        INSTRUMENTED(++stats.boundaryexpansions;)
         touchboundary = -1;
         for (int i = sinister.first; i != 0; ++i)
         {
-            temp1 = make_pair(i,
-                              int(-float(upper.second) / float(sinister.first) *
-                                  float(i) +
-                                  float(upper.second)));
-            add(temp1);
-            temp1 = make_pair(i,
-                              int(-float(lower.second) / float(sinister.first) *
-                                  float(i) +
-                                  float(lower.second)));
-            add(temp1);
+            add(make_pair(i, boundaryexponent(upper.second, sinister.first, i)));
+            add(make_pair(i, boundaryexponent(lower.second, sinister.first, i)));
         }
         for (int i = 0; i != dexter.first; ++i)
         {
-            temp1 = make_pair(i,
-                              int(-float(upper.second) / float(dexter.first) *
-                                  float(i) +
-                                  float(upper.second)));
-            add(temp1);
-            temp1 = make_pair(i,
-                              int(-float(lower.second) / float(dexter.first) *
-                                  float(i) +
-                                  float(lower.second)));
-            add(temp1);
+            add(make_pair(i, boundaryexponent(upper.second, dexter.first, i)));
+            add(make_pair(i, boundaryexponent(lower.second, dexter.first, i)));
         }
     }
-    current.erase(monomial);
+    // The coefficient is raised until monomial ties with the minimum of the others at the point. This does not go
+    // through setcoefficient: pseudorelax already took monomial out of the cached tie sets that contained it.
+    number& coef = current[monomial];
+    number old = coef;
     temp1 = unstable[pointnumber];
-    for (map<pair<int, int>, int>::iterator i = current.begin(); i != current.end(); ++i)
+    temp2 = envelope.minimum(temp1, &newmon, &monomial);
+    coef = temp2 -
+           monomial.first * temp1.first -
+           monomial.second * temp1.second;
+    envelope.set(monomial, coef);
+    if (coef <= old)                            // Only possible if the boundary monomials just added undercut it
     {
-        temp3.push_back(i->first.first * temp1.first +
-                        i->first.second * temp1.second +
-                        i->second);
+        argmins.clear();
     }
-    temp2 = minimum(temp3);
-    current[monomial] = temp2 -
-                        monomial.first * temp1.first	-
-                        monomial.second * temp1.second;
-    
-    vector<pair<int, int> > newmon = minimalmonomials(temp1);
-    set<int> temp4;
-    for(auto it : newmon)
+    newmon.insert(lower_bound(newmon.begin(), newmon.end(), monomial), monomial);
+    argmins.store(pointnumber, temp2, newmon);
+    registerpoint(pointnumber, newmon);
+}
+
+template <typename number, typename coordinate>
+coordinate tropicalsandpile<number, coordinate>::boundaryexponent(coordinate end, coordinate extreme, coordinate i) const
+{                                               // j of the segment from (0, end) to (extreme, 0) at i, truncated to 0
+    return segmentexponent(end, extreme, i);
+}
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::enqueue(int pointnumber)
+{
+    if (!queued[pointnumber])
     {
-        if (tocheck.find(it)==tocheck.end())
-        {
-            temp4.insert(pointnumber);
-            tocheck[it]=temp4;
-        }
-        else
-        {
-            tocheck[it].insert(pointnumber);
-        }
+        queued[pointnumber] = true;
+        checkheap.push_back(pointnumber);
+        push_heap(checkheap.begin(), checkheap.end(), greater<int>());
+        INSTRUMENTED(stats.checkpeak = max(stats.checkpeak, (long long)checkheap.size());)
     }
-    
 }
-void init(int argc, char **argv)
-{
-    if (argc > 1)
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::registerpoint(int pointnumber, const vector<pair<int, int> >& monomials) // Adds the point to
+{                                                                                               // tocheck of each monomial,
+    for (auto it : monomials)                                                                   // unless it is there already
     {
-        if (argc == 5)
+        int id = monomialid[it];
+        int node = pointnodes[pointnumber];
+        while (node != -1 && checknodes[node].monomial != id)
         {
-            m = atoi(argv[1]);
-            n = atoi(argv[2]);
-            nunstable = atoi(argv[3]);
-            mt19937 tempmt(atoi(argv[4]));
-            seed = atoi(argv[4]);
-            uniform_int_distribution<int> tempdist2(1,m-2), tempdist1(1,n-2);
-            mt=tempmt;
-            dist1=tempdist1;
-            dist2=tempdist2;
+            node = checknodes[node].pointnext;
+        }
+        if (node != -1)
+        {
+            continue;
+        }
+        node = freenode;
+        if (node == -1)
+        {
+            node = checknodes.size();
+            checknodes.push_back(checknode());
         }
         else
         {
-            cout << "Fatal error. Check number of parameters. Parameters should be: m,n,number of unstable points, seed";
-            exit(-1);
+            freenode = checknodes[node].next;
         }
+        checknodes[node].point = pointnumber;
+        checknodes[node].monomial = id;
+        checknodes[node].next = tocheck[id];
+        tocheck[id] = node;
+        checknodes[node].pointnext = pointnodes[pointnumber];
+        pointnodes[pointnumber] = node;
     }
-    else
+}
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::unlinkpoint(int node) // Takes node out of the nodes of its point
+{
+    int* link = &pointnodes[checknodes[node].point];
+    while (*link != node)
     {
-        n = 1000;								// Default grid size
-        m = n;									// By default, the grid is square
-        nunstable = 900;                       // defaul the number of unstable points
-        seed=2;                                 // default seed
-        mt19937 tempmt(seed);
-        uniform_int_distribution<int> tempdist2(1,m-2), tempdist1(1,n-2);
-        mt=tempmt;
-        dist1=tempdist1;
-        dist2=tempdist2;
+        link = &checknodes[*link].pointnext;
     }
+    *link = checknodes[node].pointnext;
+}
+template <typename number, typename coordinate>
+tropicalsandpile<number, coordinate>::tropicalsandpile(int rows, int columns, int points, int s)
+{
+    m = rows;
+    n = columns;
+    nunstable = points;
+    seed = s;
+    mt.seed(seed);
+    dist2 = uniform_int_distribution<coordinate>(1, m - 2);
+    dist1 = uniform_int_distribution<coordinate>(1, n - 2);
+    nthreads = 1;
+    rasterize = true;
+    text = false;
+    checkpoint = 0;
+    resume = false;
     upper = make_pair(0, 1);
     lower = make_pair(0, -1);
     dexter = make_pair(1, 0);
     sinister = make_pair(-1, 0);
-    current[make_pair(1, 0)] = coefficient(make_pair(1, 0));
-    current[make_pair(-1, 0)] = coefficient(make_pair(-1, 0));
-    current[make_pair(0, 1)] = coefficient(make_pair(0, 1));
-    current[make_pair(0, -1)] = coefficient(make_pair(0, -1));
-    current[make_pair(0, 0)] = coefficient(make_pair(0,0));
+    add(make_pair(1, 0));
+    add(make_pair(-1, 0));
+    add(make_pair(0, 1));
+    add(make_pair(0, -1));
+    add(make_pair(0, 0));
     unstable.resize(nunstable);
+    argmins.resize(nunstable);
+    checkheap.reserve(nunstable);
+    checknodes.reserve(4 * nunstable);          // About the total size of the tie sets of the points
+    freenode = -1;
+    pointnodes.resize(nunstable, -1);
+    queued.resize(nunstable, false);
+    processed.resize(nunstable, 0);
+    epoch = 0;
+    sizes.reserve(nunstable);
+    volumes.reserve(nunstable);
 }
 
-void pseudorelax()                          //Analogue of the relaxation function for sandpiles
-{
-    vector<pair<int, int> > monomial;
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::pseudorelax()        //Analogue of the relaxation function for sandpiles
+{                                           //Only touches preallocated storage, unless the boundary grows
     int pointnumber; // index of the unstable point to relax
-    for (int i=0;i< K+1 ; ++i)
+    ++epoch;
+    while (!checkheap.empty())
     {
-        processed.push_back(false);
+        pop_heap(checkheap.begin(), checkheap.end(), greater<int>());
+        pointnumber = checkheap.back();
+        checkheap.pop_back();
+        queued[pointnumber] = false;
+        bool cached = minimalmonomials(pointnumber, ties);
+        if (ties.size() == 1)
+        {
+            pair<int, int> monomial = ties[0];
+            int& first = tocheck[monomialid[monomial]];
+            int node = first;
+            INSTRUMENTED(long long length = 0;)
+            while (node != -1)
+            {
+                INSTRUMENTED(++length;)
+                enqueue(checknodes[node].point);
+                argmins.raise(checknodes[node].point, monomial);
+                unlinkpoint(node);
+                int next = checknodes[node].next;
+                checknodes[node].next = freenode;   // back to the free list
+                freenode = node;
+                node = next;
+            }
+            first = -1;
+            INSTRUMENTED(++stats.drains; stats.fanout += length; stats.fanoutmax = max(stats.fanoutmax, length);)
+            operatorgp(monomial, pointnumber);
+            ++volume;
+            if (processed[pointnumber] != epoch)
+            {
+                ++avalanchesize;
+                processed[pointnumber] = epoch;
+            }
+        }
+        else if (!cached)                   // A cached tie set is registered already
+        {
+            registerpoint(pointnumber, ties);
+        }
     }
-    while (!checkset.empty())
+}
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::rasterizecurve(vector<pair<int, int> >& result) // Appends the cells of the curve, ordered as
+{                                                                       // ih(0), ih(1), ...
+    monomialarrays<number> p(current);
+    int bands = (m + TILEROWS - 1) / TILEROWS;
+    vector<vector<pair<int, int> > > bandcurve(bands);
+    atomic<int> next(0);
+    auto worker = [&]()
     {
-        pointnumber = *(checkset.begin());
-        checkset.erase(checkset.begin());   
-        monomial = minimalmonomials(unstable[pointnumber]);
-        if (monomial.size() == 1)
+        vector<int> candidates;
+        vector<char> flags(TILEROWS * n);
+        int b;
+        while ((b = next++) < bands)
         {
-            if (tocheck.find(monomial[0])!=tocheck.end())
+            int x0 = b * TILEROWS, x1 = min(m, x0 + TILEROWS);
+            for (int y0 = 0; y0 < n; y0 += TILECOLUMNS)
             {
-                for(auto it : tocheck[monomial[0]])
+                rasterizetile(p, x0, x1, y0, min(n, y0 + TILECOLUMNS), candidates, &flags.front(), n);
+            }
+            for (int x = x0; x < x1; ++x)
+            {
+                for (int y = 0; y < n; ++y)
                 {
-                    checkset.insert(it);
+                    if (flags[(x - x0) * n + y])
+                    {
+                        bandcurve[b].push_back(make_pair(x, y));
+                    }
                 }
-                tocheck[monomial[0]].clear();
             }
-            operatorgp(monomial[0],pointnumber);
-            ++volume;
-            if (processed[pointnumber] == false)
+        }
+    };
+    vector<thread> workers;
+    for (int i = 1; i < nthreads; ++i)
+    {
+        workers.push_back(thread(worker));
+    }
+    worker();
+    for (unsigned int i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+    for (int b = 0; b < bands; ++b)
+    {
+        result.insert(result.end(), bandcurve[b].begin(), bandcurve[b].end());
+    }
+}
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::writecurve(const string& path) // Exact output of the curve as vertices, edges and rays
+{
+    vector<long long> px, py, pz;
+    for (auto i = current.begin(); i != current.end(); ++i)
+    {
+        px.push_back(i->first.first);
+        py.push_back(i->first.second);
+        pz.push_back(i->second);
+    }
+    convexhull hull(px, py, pz);
+    vector<int> parent(hull.faces.size());
+    for (unsigned int f = 0; f < hull.faces.size(); ++f)
+    {
+        parent[f] = f;
+    }
+    // Lower faces (outward normal pointing down) sharing a plane are the same cell
+    for (unsigned int f = 0; f < hull.faces.size(); ++f)
+    {
+        if (!hull.faces[f].alive || hull.faces[f].nz >= 0)
+        {
+            continue;
+        }
+        for (int k = 0; k < 3; ++k)
+        {
+            int g = hull.faces[f].neighbor[k];
+            if (hull.faces[g].nz < 0)
             {
-                ++avalanchesize;
-                processed[pointnumber] = true;
+                int opposite = 0;
+                while (hull.faces[g].v[opposite] == hull.faces[f].v[k] ||
+                       hull.faces[g].v[opposite] == hull.faces[f].v[(k + 1) % 3])
+                {
+                    ++opposite;
+                }
+                if (hull.side(f, hull.faces[g].v[opposite]) == 0)
+                {
+                    parent[findcell(parent, f)] = findcell(parent, g);
+                }
             }
         }
-        else
-        {
-            set<int> temp4;
-            for(auto it : monomial)
+    }
+    vector<int> vertex(hull.faces.size(), -1);
+    vector<long long> vertices;                 // X, Y, D for each vertex (X/D, Y/D)
+    map<pair<int, int>, int> edges;             // (vertex, vertex) -> weight
+    map<pair<int, pair<int, int> >, int> rays;  // (vertex, direction) -> weight
+    for (unsigned int f = 0; f < hull.faces.size(); ++f)
+    {
+        const hullface& face = hull.faces[f];
+        if (!face.alive || face.nz >= 0)
+        {
+            continue;
+        }
+        int cell = findcell(parent, f);
+        if (vertex[cell] == -1)
+        {
+            // The cell's plane is a = -X*i - Y*j + c, so all its monomials tie at (X, Y)
+            const hullface& root = hull.faces[cell];
+            long long g = gcd(gcd(root.nx, root.ny), root.nz);
+            vertex[cell] = vertices.size() / 3;
+            vertices.push_back(-root.nx / g);
+            vertices.push_back(-root.ny / g);
+            vertices.push_back(-root.nz / g);
+        }
+        for (int k = 0; k < 3; ++k)
+        {
+            int u = face.v[k], w = face.v[(k + 1) % 3];
+            long long dx = hull.x[w] - hull.x[u], dy = hull.y[w] - hull.y[u];
+            int weight = gcd(dx, dy);
+            int g = face.neighbor[k];
+            if (hull.faces[g].nz < 0)
             {
-                if (tocheck.find(it)==tocheck.end())
+                int other = findcell(parent, g);
+                if (other != cell && int(f) < g)
                 {
-                    temp4.insert(pointnumber);
-                    tocheck[it] = temp4;
+                    if (vertex[other] == -1)
+                    {
+                        const hullface& root = hull.faces[other];
+                        long long d = gcd(gcd(root.nx, root.ny), root.nz);
+                        vertex[other] = vertices.size() / 3;
+                        vertices.push_back(-root.nx / d);
+                        vertices.push_back(-root.ny / d);
+                        vertices.push_back(-root.nz / d);
+                    }
+                    edges[make_pair(min(vertex[cell], vertex[other]), max(vertex[cell], vertex[other]))] += weight;
                 }
-                else
+            }
+            else
+            {
+                // Border of the Newton polygon: the ray goes along its inner normal
+                int r = face.v[(k + 2) % 3];
+                int rx = -dy / weight, ry = dx / weight;
+                if (rx * (hull.x[r] - hull.x[u]) + ry * (hull.y[r] - hull.y[u]) < 0)
                 {
-                    tocheck[it].insert(pointnumber);
+                    rx = -rx;
+                    ry = -ry;
                 }
+                rays[make_pair(vertex[cell], make_pair(rx, ry))] += weight;
             }
         }
     }
-    
+    ofstream output(path.c_str(), ios::out | ofstream::binary);
+    int count = vertices.size() / 3;
+    output.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (unsigned int i = 0; i < vertices.size(); ++i)
+    {
+        output.write(reinterpret_cast<const char *>(&vertices[i]), sizeof(vertices[i]));
+    }
+    count = edges.size();
+    output.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (map<pair<int, int>, int>::iterator i = edges.begin(); i != edges.end(); ++i)
+    {
+        output.write(reinterpret_cast<const char *>(&(i->first.first)), sizeof(i->first.first));
+        output.write(reinterpret_cast<const char *>(&(i->first.second)), sizeof(i->first.second));
+        output.write(reinterpret_cast<const char *>(&(i->second)), sizeof(i->second));
+    }
+    count = rays.size();
+    output.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (map<pair<int, pair<int, int> >, int>::iterator i = rays.begin(); i != rays.end(); ++i)
+    {
+        output.write(reinterpret_cast<const char *>(&(i->first.first)), sizeof(i->first.first));
+        output.write(reinterpret_cast<const char *>(&(i->first.second.first)), sizeof(i->first.second.first));
+        output.write(reinterpret_cast<const char *>(&(i->first.second.second)), sizeof(i->first.second.second));
+        output.write(reinterpret_cast<const char *>(&(i->second)), sizeof(i->second));
+    }
+    output.close();
 }
-void writeout()
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::writeout()
 {
+    INSTRUMENTED(auto start = chrono::steady_clock::now();)
     // Output of final state of the grid
-    vector<pair<int, int> > temp1;
-    int i = seed;
     std::string text = "./tsandpile/grid";
-    //text += std::to_string(i);
+    text += suffix;
     text += ".dat";
-    for (int i = 0; i < n * m; ++i)
-    {
-        temp1 = minimalmonomials(ih(i));
-        if (temp1.size() > 1)
-        {
-            curve.push_back(ih(i));
-        }
-    }
+    if (rasterize)
+    {
+        rasterizecurve(curve);
+    }
     curvesize = curve.size();
 
     string path(text);
@@ -345,7 +1472,7 @@ void writeout()
     
     // Output of map (i,j)->a_{i,j}
     text = "./tsandpile/active";
-    //text += std::to_string(i);
+    text += suffix;
     text += ".dat";
     path = text;
     int actlen = current.size();
@@ -358,75 +1485,551 @@ void writeout()
         output.write(reinterpret_cast<const char *>(&(i->second)),sizeof(i->second));
     }
     output.close();
+
+    // Exact curve: vertices, edges and rays with their weights
+    writecurve("./tsandpile/curve" + suffix + ".dat");
+    INSTRUMENTED(stats.writeout = secondssince(start);)
+    INSTRUMENTED(writereport("./tsandpile/report" + suffix + ".json");)
 }
 
-//============================================================================
-// Parameters:
-// m,n,number_of_added_points, seed
-// -- m,n are the sides of the rectangular
-// -- number_of_added_points,  number of initial unstable cells (at random positions)
-// output:
-// power_n_seed.txt -- sizes of the avalanches
-// ...w.txt -- number of operations during avalanches
-// ...a_00,a01,a10,a11,degree.txt -- files with such parameters of curves.
-//============================================================================
-int main(int argc, char **argv)
+#ifdef INSTRUMENT
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::writereport(const string& path) const
 {
-    init(argc,argv);
-    
-    string path("./tsandpile/power" + to_string(n) + "_" + to_string(nunstable) + "_" + to_string(seed) + ".txt");
-    string pathw("./tsandpile/power" + to_string(n) + "_" + to_string(nunstable) + "_" + to_string(seed) + "w.txt");
-    string patha00("./tsandpile/power" + to_string(n) + "_" + to_string(nunstable) + "_" + to_string(seed) + "a00.txt");
-    string patha10("./tsandpile/power" + to_string(n) + "_" + to_string(nunstable) + "_" + to_string(seed) + "a10.txt");
-    string patha01("./tsandpile/power" + to_string(n) + "_" + to_string(nunstable) + "_" + to_string(seed) + "a01.txt");
-    string patha11("./tsandpile/power" + to_string(n) + "_" + to_string(nunstable) + "_" + to_string(seed) + "a11.txt");
-    string pathdegree("./tsandpile/power" + to_string(n) + "_" + to_string(nunstable) + "_" + to_string(seed) + "degree.txt");
-    
     ofstream output(path.c_str(), ios::out );
-    ofstream outputw(pathw.c_str(), ios::out );
-    ofstream outputa00(patha00.c_str(), ios::out );
-    ofstream outputa10(patha10.c_str(), ios::out );
-    ofstream outputa01(patha01.c_str(), ios::out );
-    ofstream outputa11(patha11.c_str(), ios::out );
-    ofstream outputdegree(pathdegree.c_str(), ios::out );
+    output << "{\n" <<
+              "  \"m\": " << m << ",\n" <<
+              "  \"n\": " << n << ",\n" <<
+              "  \"nunstable\": " << nunstable << ",\n" <<
+              "  \"seed\": " << seed << ",\n" <<
+              "  \"coefficientbits\": " << 8 * sizeof(number) << ",\n" <<
+              "  \"monomials\": " << current.size() << ",\n" <<
+              "  \"minimalmonomialscalls\": " << stats.minimalmonomialscalls << ",\n" <<
+              "  \"cachehits\": " << stats.cachehits << ",\n" <<
+              "  \"columnsscanned\": " << envelope.scanned << ",\n" <<
+              "  \"operatorgpcalls\": " << stats.operatorgpcalls << ",\n" <<
+              "  \"boundaryexpansions\": " << stats.boundaryexpansions << ",\n" <<
+              "  \"checkpeak\": " << stats.checkpeak << ",\n" <<
+              "  \"tocheckdrains\": " << stats.drains << ",\n" <<
+              "  \"tocheckfanout\": " << stats.fanout << ",\n" <<
+              "  \"tocheckfanoutmax\": " << stats.fanoutmax << ",\n" <<
+              "  \"simulationseconds\": " << stats.simulation << ",\n" <<
+              "  \"finalcheckseconds\": " << stats.finalcheck << ",\n" <<
+              "  \"writeoutseconds\": " << stats.writeout << "\n" <<
+              "}\n";
+    output.close();
+}
+#endif
+
+template <typename number, typename coordinate>
+string tropicalsandpile<number, coordinate>::powername() const
+{
+    return "./tsandpile/power" + to_string(n) + "_" + to_string(nunstable) + "_" + to_string(seed);
+}
+
+//Checkpoints =================================================================
+// The checkpoint file power...ckpt has all that the rest of the run depends
+// on: m, n, nunstable, seed, K, upper, lower, dexter, sinister, the sizes of
+// the text files, the widths of number and coordinate, the monomials of current, the first K unstable points, the
+// lists of tocheck and the state of mt. argmins, envelope and the ids of the
+// monomials are rebuilt from them. sizes, volumes and fit are read back from
+// the first K records of the .bin file, and all the outputs are cut there, so
+// a resumed run writes exactly the same files as a run that was not stopped.
+// The file is written aside and renamed, a crash never leaves half of it.
+//=============================================================================
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::savecheckpoint(const vector<long long>& offsets) // offsets: sizes of the text files, -1 if
+{                                                                        // they are not written
+    string path(powername() + ".ckpt");
+    ofstream output((path + ".tmp").c_str(), ios::out | ios::binary);
+    int header[] =
+    {
+        m, n, nunstable, seed, K,
+        upper.first, upper.second, lower.first, lower.second,
+        dexter.first, dexter.second, sinister.first, sinister.second,
+        int(offsets.size()), int(current.size()),
+        int(sizeof(number)), int(sizeof(coordinate))
+    };
+    output.write(reinterpret_cast<const char *>(header), sizeof(header));
+    output.write(reinterpret_cast<const char *>(&offsets.front()), offsets.size() * sizeof(long long));
+    for (auto i = current.begin(); i != current.end(); ++i)
+    {
+        output.write(reinterpret_cast<const char *>(&(i->first.first)),sizeof(i->first.first));
+        output.write(reinterpret_cast<const char *>(&(i->first.second)),sizeof(i->first.second));
+        output.write(reinterpret_cast<const char *>(&(i->second)),sizeof(i->second));
+    }
+    output.write(reinterpret_cast<const char *>(&unstable.front()), K * sizeof(unstable.front()));
+    for (auto i = monomialid.begin(); i != monomialid.end(); ++i) // Lists of tocheck, each ends with -1
+    {
+        for (int node = tocheck[i->second]; node != -1; node = checknodes[node].next)
+        {
+            output.write(reinterpret_cast<const char *>(&(checknodes[node].point)), sizeof(int));
+        }
+        int end = -1;
+        output.write(reinterpret_cast<const char *>(&end), sizeof(end));
+    }
+    ostringstream state;
+    state << mt;
+    string temp = state.str();
+    int length = temp.size();
+    output.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    output.write(temp.c_str(), length);
+    output.close();
+    rename((path + ".tmp").c_str(), path.c_str());
+}
+
+template <typename number, typename coordinate>
+bool tropicalsandpile<number, coordinate>::loadcheckpoint(vector<long long>& offsets) // false if there is no checkpoint
+{
+    ifstream input((powername() + ".ckpt").c_str(), ios::in | ios::binary);
+    if (!input)
+    {
+        return false;
+    }
+    int header[17];
+    input.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (header[0] != m || header[1] != n || header[2] != nunstable || header[3] != seed ||
+        header[13] != int(offsets.size()))
+    {
+        cout << "Fatal error. The checkpoint " << powername() << ".ckpt is for other parameters" << endl;
+        exit(-1);
+    }
+    if (header[15] != int(sizeof(number)) || header[16] != int(sizeof(coordinate)))
+    {
+        cout << "Fatal error. The checkpoint " << powername() << ".ckpt has " << 8 * header[15] << " bit coefficients and "
+             << 8 * header[16] << " bit coordinates, this run " << 8 * sizeof(number) << " and " << 8 * sizeof(coordinate)
+             << " bit (--wide)" << endl;
+        exit(-1);
+    }
+    K = header[4];
+    upper = make_pair(header[5], header[6]);
+    lower = make_pair(header[7], header[8]);
+    dexter = make_pair(header[9], header[10]);
+    sinister = make_pair(header[11], header[12]);
+    input.read(reinterpret_cast<char *>(&offsets.front()), offsets.size() * sizeof(long long));
+    // Straight into current and envelope: setcoefficient would go through argmins for each monomial, and there is
+    // nothing cached yet
+    current.clear();
+    envelope = lowerenvelope<number, coordinate>();
+    monomialid.clear();
+    tocheck.clear();
+    checknodes.clear();
+    freenode = -1;
+    pointnodes.assign(nunstable, -1);
+    for (int k = 0; k < header[14]; ++k)
+    {
+        pair<int, int> monomial;
+        number value;
+        input.read(reinterpret_cast<char *>(&monomial.first), sizeof(monomial.first));
+        input.read(reinterpret_cast<char *>(&monomial.second), sizeof(monomial.second));
+        input.read(reinterpret_cast<char *>(&value), sizeof(value));
+        current[monomial] = value;
+        envelope.set(monomial, value);
+        monomialid[monomial] = tocheck.size();
+        tocheck.push_back(-1);
+    }
+    input.read(reinterpret_cast<char *>(&unstable.front()), K * sizeof(unstable.front()));
+    vector<pair<int, int> > monomial(1);
+    for (auto i = monomialid.begin(); i != monomialid.end(); ++i)
+    {
+        monomial[0] = i->first;
+        int point;
+        while (input.read(reinterpret_cast<char *>(&point), sizeof(point)) && point != -1)
+        {
+            registerpoint(point, monomial);
+        }
+    }
+    int length = 0;
+    input.read(reinterpret_cast<char *>(&length), sizeof(length));
+    string temp(length, ' ');
+    input.read(&temp[0], length);
+    if (!input)
+    {
+        cout << "Fatal error. The checkpoint " << powername() << ".ckpt is truncated" << endl;
+        exit(-1);
+    }
+    istringstream state(temp);
+    state >> mt;
+    argmins.clear();
+    return true;
+}
+
+template <typename number, typename coordinate>
+void tropicalsandpile<number, coordinate>::run()
+{
+    string path(powername() + ".txt");
+    string pathw(powername() + "w.txt");
+    string patha00(powername() + "a00.txt");
+    string patha10(powername() + "a10.txt");
+    string patha01(powername() + "a01.txt");
+    string patha11(powername() + "a11.txt");
+    string pathdegree(powername() + "degree.txt");
+    string pathrecords(powername() + ".bin");
+    
+    ofstream output, outputw, outputa00, outputa10, outputa01, outputa11, outputdegree;
+    ofstream* streams[] = {&output, &outputw, &outputa00, &outputa10, &outputa01, &outputa11, &outputdegree};
+    const string* paths[] = {&path, &pathw, &patha00, &patha10, &patha01, &patha11, &pathdegree};
+    vector<long long> offsets(7, -1);
+    avalancherecord<number> record = avalancherecord<number>(); // Zeroes the padding too
+    ofstream records;
     
     K = 0;
-    for (int i=0; i < nunstable; ++i)
+    if (resume && loadcheckpoint(offsets))
+    {
+        if (text && offsets[0] == -1)
+        {
+            cout << "Fatal error. The checkpoint was saved without --text" << endl;
+            exit(-1);
+        }
+        long long recordsize = 4 * sizeof(int) + (long long)K * sizeof(record);
+        if (truncate(pathrecords.c_str(), recordsize) != 0)
+        {
+            cout << "Fatal error. Cannot cut " << pathrecords << " to the checkpoint" << endl;
+            exit(-1);
+        }
+        ifstream input(pathrecords.c_str(), ios::in | ios::binary); // sizes, volumes and fit as they were
+        input.seekg(4 * sizeof(int));
+        for (int i = 0; i < K && input.read(reinterpret_cast<char *>(&record), sizeof(record)); ++i)
+        {
+            sizes.push_back(float(record.boundary)*float(record.size)/float(record.points));
+            volumes.push_back(float(record.boundary)*float(record.volume)/float(record.points));
+            if (record.boundary == 1 && record.size > 0)
+            {
+                fit.add(sizes.back());
+            }
+        }
+        records.open(pathrecords.c_str(), ios::out | ios::binary | ios::app);
+        for (int k = 0; k < 7 && text; ++k)
+        {
+            if (truncate(paths[k]->c_str(), offsets[k]) != 0)
+            {
+                cout << "Fatal error. Cannot cut " << *paths[k] << " to the checkpoint" << endl;
+                exit(-1);
+            }
+            streams[k]->open(paths[k]->c_str(), ios::out | ios::app );
+        }
+    }
+    else
+    {
+        for (int k = 0; k < 7 && text; ++k)
+        {
+            streams[k]->open(paths[k]->c_str(), ios::out );
+        }
+        records.open(pathrecords.c_str(), ios::out | ios::binary);
+        records.write(reinterpret_cast<const char *>(&m), sizeof(m));
+        records.write(reinterpret_cast<const char *>(&n), sizeof(n));
+        records.write(reinterpret_cast<const char *>(&nunstable), sizeof(nunstable));
+        records.write(reinterpret_cast<const char *>(&seed), sizeof(seed));
+    }
+    
+    INSTRUMENTED(auto start = chrono::steady_clock::now();)
+    for (int i=K; i < nunstable; ++i)
     {
         touchboundary = 1;
         unstable[i].first = dist1(mt);
         unstable[i].second = dist2(mt);
-        checkset.insert(K);
+        enqueue(K);
         ++K;
         avalanchesize = 0;
         volume = 0;
         pseudorelax();
-        processed.clear();
         //cout<< i<<"\t"<<operationscount<<"\t"<<volume<<endl;
-        output<<to_string(float(touchboundary)*float(avalanchesize)/float(K))+",";
-        outputw<<to_string(float(touchboundary)*float(volume)/float(K))+",";
-        outputa00<<to_string(current[make_pair(0, 0)])+",";
-        outputa10<<to_string(current[make_pair(1, 0)])+",";
-        outputa01<<to_string(current[make_pair(0, 1)])+",";
-        outputa11<<to_string(current[make_pair(1, 1)])+",";
-        outputdegree<<to_string(upper.second+dexter.first)+",";
+        sizes.push_back(float(touchboundary)*float(avalanchesize)/float(K));
+        volumes.push_back(float(touchboundary)*float(volume)/float(K));
+        add(make_pair(1, 1));                   // a_11 is created with coefficient 0 if it is not there yet
+        record.points = K;
+        record.size = avalanchesize;
+        record.volume = volume;
+        record.boundary = touchboundary;
+        record.a00 = current[make_pair(0, 0)];
+        record.a10 = current[make_pair(1, 0)];
+        record.a01 = current[make_pair(0, 1)];
+        record.a11 = current[make_pair(1, 1)];
+        record.degree = upper.second+dexter.first;
+        records.write(reinterpret_cast<const char *>(&record), sizeof(record));
+        if (touchboundary == 1 && avalanchesize > 0)
+        {
+            fit.add(sizes.back());
+        }
+        if (text)
+        {
+            output<<to_string(sizes.back())+",";
+            outputw<<to_string(volumes.back())+",";
+            outputa00<<to_string(record.a00)+",";
+            outputa10<<to_string(record.a10)+",";
+            outputa01<<to_string(record.a01)+",";
+            outputa11<<to_string(record.a11)+",";
+            outputdegree<<to_string(record.degree)+",";
+        }
+        if (checkpoint > 0 && K % checkpoint == 0 && K < nunstable)
+        {
+            records.flush();
+            for (int k = 0; k < 7 && text; ++k)
+            {
+                streams[k]->flush();
+                offsets[k] = streams[k]->tellp();
+            }
+            savecheckpoint(offsets);
+        }
     }
+    records.close();
+    INSTRUMENTED(stats.simulation = secondssince(start);)
+    if (checkpoint > 0)
+    {
+        remove((powername() + ".ckpt").c_str());  // The run is complete
+    }
+    fit.write(powername() + "hist.txt");
     // final check
+    INSTRUMENTED(start = chrono::steady_clock::now();)
     for (int i=0; i < nunstable; ++i)
     {
-        vector<pair<int, int> > temp1;
-        temp1 = minimalmonomials(unstable[i]);
-        if (temp1.size() == 1)
+        minimalmonomials(i, ties);
+        if (ties.size() == 1)
         {
             std::cout << "did NOT stabilized!" << std::endl;
             std::cout <<i << std::endl;
         }
         
     }
+    INSTRUMENTED(stats.finalcheck = secondssince(start);)
     output.close();
     outputw.close();
-    
-    // produces a file with data with actual tropical curve to draw
-    writeout();
+}
+
+class parameters                                // What init reads from the command line
+{
+    public:
+        int m, n, nunstable, seed;
+        int ensemble;                           // Number of seeds to run (seed, seed+1, ...), 0 for a single run
+        int threads;                            // Threads for the ensemble, or for writeout in a single run
+        bool rasterize;
+        bool text;                              // Also write the power...txt text files
+        int checkpoint;                         // Avalanches between checkpoints, 0 for none
+        bool resume;
+        bool wide;                              // 64 bit coefficients and coordinates
+};
+
+parameters init(int argc, char **argv)
+{
+    parameters p;
+    vector<char *> args(1, argv[0]);            // argv without the options
+    p.rasterize = true;
+    p.text = false;
+    p.checkpoint = 0;
+    p.resume = false;
+    p.wide = false;
+    p.ensemble = 0;
+    p.threads = max(1u, thread::hardware_concurrency());
+    for (int a = 1; a < argc; ++a)
+    {
+        if (string(argv[a]) == "--vector-only")
+        {
+            p.rasterize = false;
+        }
+        else if (string(argv[a]) == "--text")
+        {
+            p.text = true;
+        }
+        else if (string(argv[a]) == "--checkpoint" && a + 1 < argc)
+        {
+            p.checkpoint = max(0, atoi(argv[++a]));
+        }
+        else if (string(argv[a]) == "--resume")
+        {
+            p.resume = true;
+        }
+        else if (string(argv[a]) == "--wide")
+        {
+            p.wide = true;
+        }
+        else if (string(argv[a]) == "--ensemble" && a + 1 < argc)
+        {
+            p.ensemble = atoi(argv[++a]);
+        }
+        else if (string(argv[a]) == "--threads" && a + 1 < argc)
+        {
+            p.threads = max(1, atoi(argv[++a]));
+        }
+        else
+        {
+            args.push_back(argv[a]);
+        }
+    }
+    argc = args.size();
+    argv = &args.front();
+    if (argc > 1)
+    {
+        if (argc == 5)
+        {
+            p.m = atoi(argv[1]);
+            p.n = atoi(argv[2]);
+            p.nunstable = atoi(argv[3]);
+            p.seed = atoi(argv[4]);
+        }
+        else
+        {
+            cout << "Fatal error. Check number of parameters. Parameters should be: m,n,number of unstable points, seed";
+            exit(-1);
+        }
+    }
+    else
+    {
+        p.n = 1000;								// Default grid size
+        p.m = p.n;								// By default, the grid is square
+        p.nunstable = 900;                     // defaul the number of unstable points
+        p.seed=2;                               // default seed
+    }
+    p.wide = p.wide || needswide(p.m, p.n);
+    return p;
+}
+
+template <typename number, typename coordinate>
+void runensemble(const parameters& p)          // Runs the seeds p.seed, ..., p.seed+p.ensemble-1 on p.threads threads
+{
+    vector<vector<float> > sizes(p.ensemble), volumes(p.ensemble);
+    vector<powerlawfit> fits(p.ensemble);
+    vector<string> names(p.ensemble);
+    atomic<int> next(0);
+    auto worker = [&]()
+    {
+        int k;
+        while ((k = next++) < p.ensemble)
+        {
+            tropicalsandpile<number, coordinate> s(p.m, p.n, p.nunstable, p.seed + k);
+            s.rasterize = p.rasterize;
+            s.text = p.text;
+            s.checkpoint = p.checkpoint;
+            s.resume = p.resume;
+            s.suffix = to_string(p.seed + k);
+            s.run();
+            s.writeout();
+            sizes[k].swap(s.sizes);
+            volumes[k].swap(s.volumes);
+            fits[k] = s.fit;
+            names[k] = s.powername();
+        }
+    };
+    vector<thread> workers;
+    for (int i = 1; i < min(p.threads, p.ensemble); ++i)
+    {
+        workers.push_back(thread(worker));
+    }
+    worker();
+    for (unsigned int i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+    // Merged data of all the seeds, in the order of the seeds
+    string name("./tsandpile/power" + to_string(p.n) + "_" + to_string(p.nunstable) + "_" + to_string(p.seed) + "-" +
+                to_string(p.seed + p.ensemble - 1));
+    powerlawfit fit;
+    for (int k = 0; k < p.ensemble; ++k)
+    {
+        fit.merge(fits[k]);
+    }
+    fit.write(name + "hist.txt");
+    fit.report(cout);
+    ofstream records((name + ".bin").c_str(), ios::out | ios::binary); // The header of the first seed, then the
+    int header[] = {p.m, p.n, p.nunstable, p.seed};                    // records of every seed as they are in its file
+    records.write(reinterpret_cast<const char *>(header), sizeof(header));
+    for (int k = 0; k < p.ensemble; ++k)
+    {
+        ifstream input((names[k] + ".bin").c_str(), ios::in | ios::binary);
+        input.seekg(sizeof(header));
+        records << input.rdbuf();
+    }
+    records.close();
+    if (!p.text)
+    {
+        return;
+    }
+    ofstream output((name + ".txt").c_str(), ios::out );
+    ofstream outputw((name + "w.txt").c_str(), ios::out );
+    for (int k = 0; k < p.ensemble; ++k)
+    {
+        for (unsigned int i = 0; i < sizes[k].size(); ++i)
+        {
+            output<<to_string(sizes[k][i])+",";
+            outputw<<to_string(volumes[k][i])+",";
+        }
+    }
+    output.close();
+    outputw.close();
+}
+
+template <typename number, typename coordinate>
+void runsingle(const parameters& p)
+{
+    tropicalsandpile<number, coordinate> s(p.m, p.n, p.nunstable, p.seed);
+    s.nthreads = p.threads;
+    s.rasterize = p.rasterize;
+    s.text = p.text;
+    s.checkpoint = p.checkpoint;
+    s.resume = p.resume;
+    s.run();
+    s.fit.report(cout);
+    
+    // produces a file with data with actual tropical curve to draw
+    s.writeout();
+}
+
+//============================================================================
+// Parameters:
+// m,n,number_of_added_points, seed [--vector-only] [--text] [--checkpoint c] [--resume]
+//                                    [--wide] [--ensemble k] [--threads t]
+// -- m,n are the sides of the rectangular
+// -- number_of_added_points,  number of initial unstable cells (at random positions)
+// -- --vector-only skips the pixel curve in grid.dat (curve.dat is always written)
+// -- --text also writes the text files below (power...txt, ...w.txt, ...)
+// -- --checkpoint c saves the state to power_n_seed.ckpt every c avalanches
+// -- --resume goes on from power_n_seed.ckpt if it is there, with the same
+//    results as if the run had not been stopped
+// -- --wide uses 64 bit coefficients and coordinates, which is the default
+//    when 2*(m+1)*(n+1) does not fit in an int; then the coefficients in
+//    power_n_seed.bin, active.dat and the unstable points in grid.dat are 64 bit
+// -- --ensemble k runs the seeds seed,...,seed+k-1 in parallel on t threads
+//    (default: all the cores)
+// output:
+// power_n_seed.bin -- m, n, number_of_added_points, seed, then one avalancherecord
+//                     per avalanche
+// power_n_seedhist.txt -- log-binned histogram of the sizes of the avalanches
+//                         that did not touch the boundary; the maximum likelihood
+//                         power law exponent is printed at the end
+// with --text:
+// power_n_seed.txt -- sizes of the avalanches
+// ...w.txt -- number of operations during avalanches
+// ...a_00,a01,a10,a11,degree.txt -- files with such parameters of curves.
+// grid.dat, active.dat, curve.dat -- final curve (pixels), monomials, exact curve
+// report.json -- counters and timings of the run, if compiled with -DINSTRUMENT
+// with --ensemble, also power_n_seed-lastseed.bin (the header of the first seed,
+// then the records of every seed one after the other), power_n_seed-lastseedhist.txt
+// and the exponent of all the seeds together (and with --text
+// power_n_seed-lastseed.txt and ...w.txt), and grid/active/curve files get the
+// seed in their names
+//============================================================================
+int main(int argc, char **argv)
+{
+    parameters p = init(argc,argv);
+    if (p.ensemble > 0)
+    {
+        if (p.wide)
+        {
+            runensemble<long long, long long>(p);
+        }
+        else
+        {
+            runensemble<int, int>(p);
+        }
+        return 0;
+    }
+    if (p.wide)
+    {
+        runsingle<long long, long long>(p);
+    }
+    else
+    {
+        runsingle<int, int>(p);
+    }
     return 0;
 }
@@ -30,38 +30,250 @@
 #include <vector>
 #include <stdlib.h>
 #include <fstream>
+#ifndef NOMPI
 #include <mpi.h>
+#endif
 #include <random>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <type_traits>
 
 using namespace std;
 
 #define CRITICAL 4								// Value at which points become unstable
 #define CRITICALMINUSONE 3
+#define LATTICESQUARE 0                         // Lattices of the avalanche modes (--lattice)
+#define LATTICETRIANGULAR 1
+#define LATTICEHEXAGONAL 2
+#define LATTICEMOORE 3
+#define BINSPERDECADE 10                        // Bins per decade of the log-binned avalanche histograms
+#define SOURCEDENSITY 2.3                       // Threshold of the approximate odometer of a single source pile. Its mean height
+                                                // is about 2.125, but with 2.3 the rounded odometer stays under the sandpile one
+                                                // but in a ring near the edge: relax tops it up one toppling at a time, which is
+                                                // much cheaper than untoppling sets of cells
+#define COARSESTSIDE 64                         // approximateodometer solves exactly the levels with no side longer than this
+#define LEVELSWEEPS 20                          // Projected SOR sweeps between the convergence checks of approximateodometer
+#define ODOMETERSLACK 1000                      // The approximate odometer stops at a change of m*n/ODOMETERSLACK per cell, well
+                                                // below the distance of order m*n between the divisible and sandpile odometers
+#define OVERRELAXATION 1.8
+#define HIGHHEIGHT (1<<29)                      // runsource topples or untopples in 64 bits the cells beyond this, before relax
+#define SWEEPDENSITY 8                          // relax switches to sweeps when more than 1/SWEEPDENSITY of the cells are unstable
 #define MASTERPROCESS 0
+#define TAGUP 10                                // Tags of the outers sent to each neighbor, named after the way the
+#define TAGDOWN 11                              // grains go
+#define TAGLEFT 12
+#define TAGRIGHT 13
+#define TAGMOVE 14                              // Tag of the tiles that move to another process
+#define TILEIDLE 0                              // States of a tile in the threaded backend: nothing to do, waiting in a
+#define TILEQUEUED 1                            // queue, being relaxed, being relaxed and with new grains arrived
+#define TILERUNNING 2
+#define TILEDIRTY 3
 
 stack< pair<int,int> > unstable1, unstable2; 	// Stacks used to store the current unstable cells in the grid
 vector< pair<int,int> > initialunstable;		// Vector used to store the initial unstable cells in the grid
 vector< pair<int,int> > localinitialunstable;		// Vector used to store the initial unstable cells in each subgrid
 vector<int> initialunstablesubgrids;
+vector<long long> initialunstableindices;      // With --counterrng, the place of each of our initial points in the list of all
 int partsx,partsy;                        // Number of parts to divide the grid in each axis, respectively
 int n,m,nunstable;								// Size of the grid, m is size in x and n is size in y
 vector<int> grid;								// Our sandpile, stored as an integer grid, the size is specified in main()
 int stepx, stepy;
 int world_rank;
+int world_size;
+bool overlap;                                   // Relax the interior while the outers travel (--overlap)
+int ghost;                                      // Depth of the ghost zones (--ghost k), 0 means no ghost zones
+int threads;                                    // Threads of the shared memory backend (--threads t), 0 means MPI
+bool packed;                                    // Keep the tiles that are not being relaxed in 2 bits per cell (--packed)
+bool counterrng;                                // Every process draws only its own initial points (--counterrng)
+bool avalanches;                                // Drop nunstable grains one by one and record the avalanches (--avalanches)
+bool ensemble;                                  // Every thread of every process drops its own grains on its own grid (--ensemble)
+long long sourcegrains;                         // Grains of the single source pile at the center (--source N), 0 if none
+bool symmetric;                                 // Simulate only a fundamental domain of the symmetries of the pile (--symmetric)
+int latticetype;                                // Lattice of the avalanche modes (--lattice), one of the LATTICE defines
+unsigned long long seed;
 
 mt19937 mt;
 uniform_int_distribution<int> dist2, dist1;
 
-vector<int> allneighborsleft;
-vector<int> allneighborsright;
-vector<int> allneighborstop;
-vector<int> allneighborsbottom;
+class avalanchestats                // What an avalanche did, filled in by topple and relax when a subgrid points to it
+{
+    public:
+        avalanchestats(int cells) : stamp(cells,0), epoch(0) {};
+        vector<int> stamp;          // stamp[i]==epoch if the cell i toppled in this avalanche
+        int epoch;
+        int size;                   // Cells that toppled
+        long long volume;           // Topplings
+        int duration;               // Waves of topplings (passes over one of the stacks of relax)
+        bool boundary;              // Some grain fell in the sink
+        vector<long long> odometer; // Topplings of every cell, kept only if not empty
+        void start();
+        void toppled(int cell, int times);
+};
+
+void avalanchestats::start()
+{
+    ++epoch;
+    size=0;
+    volume=0;
+    duration=0;
+    boundary=false;
+}
+
+void avalanchestats::toppled(int cell, int times)
+{
+    if (stamp[cell]!=epoch)
+    {
+        stamp[cell]=epoch;
+        ++size;
+    }
+    volume+=times;
+    if (!odometer.empty())
+        odometer[cell]+=times;
+}
+
+class loghistogram                  // Histogram of positive integers in bins of width 1/BINSPERDECADE in log10
+{
+    public:
+        loghistogram() : total(0) {};
+        vector<long long> counts;   // counts[k]: values in [10^(k/BINSPERDECADE), 10^((k+1)/BINSPERDECADE))
+        long long total;
+        void add(long long value);
+        void add(const loghistogram& other);
+        void write(const string& path) const; // As text: lower end, upper end, count, density
+};
+
+void loghistogram::add(long long value)
+{
+    unsigned int k=int(floor(log10(double(value))*BINSPERDECADE+1e-9));
+    if (k>=counts.size())
+        counts.resize(k+1,0);
+    ++counts[k];
+    ++total;
+}
+
+void loghistogram::add(const loghistogram& other)
+{
+    if (other.counts.size()>counts.size())
+        counts.resize(other.counts.size(),0);
+    for (unsigned int k=0; k<other.counts.size(); ++k)
+        counts[k]+=other.counts[k];
+    total+=other.total;
+}
+
+void loghistogram::write(const string& path) const
+{
+    ofstream output(path.c_str(), ios::out );
+    for (unsigned int k=0; k<counts.size(); ++k)
+    {
+        double lower=pow(10.0,double(k)/BINSPERDECADE);
+        double upper=pow(10.0,double(k+1)/BINSPERDECADE);
+        output<<lower<<" "<<upper<<" "<<counts[k]<<" "<<(total==0 ? 0 : counts[k]/(total*(upper-lower)))<<"\n";
+    }
+    output.close();
+}
+
+
+class fold                          // The cells that runsource and runsymmetric simulate: all the grid, or after symmetrize
+{                                   // the cells right of the center if m is odd, below it if n is odd, and on or under the
+    public:                         // diagonal if both are and m==n, as far as the initial cells are symmetric. The others
+                                    // have the height of their mirror image among these
+        fold(int fx, int fy) : fullx(fx), fully(fy), x0(0), y0(0), sizex(fx), sizey(fy), mirrorx(false), mirrory(false),
+                               diagonal(false) {};
+        int fullx, fully;           // The grid that is folded
+        int x0, y0;                 // Where the simulated cells start in it
+        int sizex, sizey;
+        bool mirrorx, mirrory, diagonal;
+        void symmetrize(const vector< pair<int,int> >& points); // Keeps the mirrors that leave points (in the full grid) in place
+        bool inside(int x, int y) const;                // (x,y) (from x0,y0) is a simulated cell
+        int rep(int x, int y) const;                    // Index of the simulated cell with the height of (x,y), -1 in the sink
+        int sends(int nx, int ny, int x, int y) const;  // Grains (nx,ny) gets when (x,y) topples once, 0 if not simulated
+        vector<int> receivers;      // After tabulate, the cell i sends shares[4*i+d] grains to receivers[4*i+d] (-1 for
+        vector<char> shares;        // none) in the direction d each time it topples
+        void tabulate();
+};
+
+void fold::symmetrize(const vector< pair<int,int> >& points)
+{
+    vector< pair<int,int> > sorted(points);
+    sort(sorted.begin(),sorted.end());
+    mirrorx=(fullx%2==1);
+    mirrory=(fully%2==1);
+    diagonal=(mirrorx && mirrory && fullx==fully);
+    for (unsigned int i=0; i<sorted.size(); ++i)
+    {
+        int x=sorted[i].first, y=sorted[i].second;
+        mirrorx=mirrorx && binary_search(sorted.begin(),sorted.end(),make_pair(fullx-1-x,y));
+        mirrory=mirrory && binary_search(sorted.begin(),sorted.end(),make_pair(x,fully-1-y));
+        diagonal=diagonal && binary_search(sorted.begin(),sorted.end(),make_pair(y,x));
+    }
+    diagonal=(diagonal && mirrorx && mirrory);
+    x0=mirrorx ? fullx/2 : 0;
+    y0=mirrory ? fully/2 : 0;
+    sizex=fullx-x0;
+    sizey=fully-y0;
+}
+
+bool fold::inside(int x, int y) const
+{
+    return x>=0 && x<sizex && y>=0 && y<sizey && (!diagonal || y<=x);
+}
+
+int fold::rep(int x, int y) const
+{
+    if (mirrorx && x<0)
+        x=-x;
+    if (mirrory && y<0)
+        y=-y;
+    if (diagonal && y>x)
+        swap(x,y);
+    return (x>=0 && x<sizex && y>=0 && y<sizey) ? x+y*sizex : -1;
+}
 
-vector< vector<int> > allouterleft;
-vector< vector<int> > allouterright;
-vector< vector<int> > alloutertop;
-vector< vector<int> > allouterbottom;
+int fold::sends(int nx, int ny, int x, int y) const // The neighbors of (nx,ny) that are images of (x,y): more than one
+{                                                   // only if (nx,ny) is on a mirror
+    static const int dx[4]={-1,0,1,0};
+    static const int dy[4]={0,1,0,-1};
+    if (!inside(nx,ny))
+        return 0;
+    if (!(mirrorx && nx==0) && !(mirrory && ny==0) && !(diagonal && nx==ny))
+        return 1;
+    int times=0;
+    for (int d=0; d<4; ++d)
+    {
+        if (rep(nx+dx[d],ny+dy[d])==x+y*sizex)
+            ++times;
+    }
+    return times;
+}
 
+void fold::tabulate()
+{
+    static const int dx[4]={-1,0,1,0};
+    static const int dy[4]={0,1,0,-1};
+    receivers.assign(4*sizex*sizey,-1);
+    shares.assign(4*sizex*sizey,0);
+    for (int y=0; y<sizey; ++y)
+    {
+        for (int x=0; x<sizex; ++x)
+        {
+            for (int d=0; d<4 && inside(x,y); ++d)
+            {
+                int times=sends(x+dx[d],y+dy[d],x,y);
+                if (times>0)
+                {
+                    receivers[4*(x+y*sizex)+d]=x+dx[d]+(y+dy[d])*sizex;
+                    shares[4*(x+y*sizex)+d]=times;
+                }
+            }
+        }
+    }
+}
 
 class subgrid                       // To greatly simplify calls for each thread, everything will be packed in a single object
 {
@@ -69,7 +281,7 @@ class subgrid                       // To greatly simplify calls for each thread
         int locationx,locationy;
         int sizex,sizey;            // Size of our rectangular subgrid (all of them have the same sizes in this version)
     public:
-        subgrid(){};                // Default constructor does nothing
+        subgrid() : stats(0), folded(0) {};    // Default constructor does nothing
         subgrid(int mi, int locationx, int locationy, int sizex, int sizey, int value);       // Constructor with options
         int getsizex() const;             // Getters for sizes
         int getsizey() const;
@@ -82,6 +294,21 @@ class subgrid                       // To greatly simplify calls for each thread
         vector<int> outerright;     // All of these should have sizes equal to the size of the corresponding side of our subgrid
         vector<int> outertop;       // The direction of iteration is left->right or top->bottom
         vector<int> outerbottom;
+        vector<int> innerleft;      // Grains received from the neighbors, to be added to the cells of each side
+        vector<int> innerright;
+        vector<int> innertop;
+        vector<int> innerbottom;
+        vector<int> sendleft;       // Outers being sent, so that relax can keep adding to the outers meanwhile
+        vector<int> sendright;
+        vector<int> sendtop;
+        vector<int> sendbottom;
+        vector<int> ghosted;        // Our cells plus ghost copies of the cells of the neighbors up to depth ghost, the
+        vector<int> fires;          // row length is sizex+2*ghost; fires holds the topplings of each cell in a sweep
+                                    // (with a ring of zeros around it, ghost wide or 1 wide in relax)
+        vector<unsigned char> cells;        // Our cells, 2 bits each, while the subgrid is packed (actual is then empty)
+        vector< pair<int,int> > overflow;   // Index and value of the cells of a packed subgrid that don't fit in 2 bits
+        avalanchestats* stats;      // Where topple and relax record the avalanche, if not null
+        const fold* folded;         // If not null the subgrid is all the cells of folded, and topple sends grains by it
         int myid;                   // id of the subgrid's creator
         int neighborleft;           // Process id's of the neighbors of each subgrid, -1 means it doesn't have a neighbor in that
         int neighborright;          // direction
@@ -95,6 +322,8 @@ class subgrid                       // To greatly simplify calls for each thread
 
 subgrid::subgrid(int mi, int lx, int ly, int sx, int sy, int value)
 {
+    stats=0;
+    folded=0;
     myid = mi;
     locationx=lx;
     locationy=ly;
@@ -105,6 +334,14 @@ subgrid::subgrid(int mi, int lx, int ly, int sx, int sy, int value)
     outerright.resize(sy,0);
     outertop.resize(sx,0);
     outerbottom.resize(sx,0);
+    innerleft.resize(sy,0);
+    innerright.resize(sy,0);
+    innertop.resize(sx,0);
+    innerbottom.resize(sx,0);
+    sendleft.resize(sy,0);
+    sendright.resize(sy,0);
+    sendtop.resize(sx,0);
+    sendbottom.resize(sx,0);
     if (lx/stepx < partsx - 1)
     {
         neighborright = myid + 1;
@@ -153,6 +390,20 @@ subgrid& subgrid::operator= (const subgrid&rhs)
         outerright=rhs.outerright;
         outertop=rhs.outertop;
         outerbottom=rhs.outerbottom;
+        innerleft=rhs.innerleft;
+        innerright=rhs.innerright;
+        innertop=rhs.innertop;
+        innerbottom=rhs.innerbottom;
+        sendleft=rhs.sendleft;
+        sendright=rhs.sendright;
+        sendtop=rhs.sendtop;
+        sendbottom=rhs.sendbottom;
+        ghosted=rhs.ghosted;
+        fires=rhs.fires;
+        cells=rhs.cells;
+        overflow=rhs.overflow;
+        stats=rhs.stats;
+        folded=rhs.folded;
         neighborbottom=rhs.neighborbottom;
         neighborleft=rhs.neighborleft;
         neighborright=rhs.neighborright;
@@ -222,20 +473,46 @@ int subgrid::getsizey() const
 
 int whichsubgrid(const pair<int, int> & cell ) // subgrids are numbered by putting all rows of subgrids in a single row and counting
 {
-    for(int i=0; i<partsy;i++)
+    if(cell.first<0 || cell.first>=m || cell.second<0 || cell.second>=n)
+    {
+        return -1;
+    }
+    return (cell.second/stepy)*partsx + cell.first/stepx;
+}
+
+void pack(subgrid& s)               // Stores the cells of s in 2 bits each, the unstable ones go to s.overflow
+{
+    s.cells.assign((s.actual.size()+3)/4,0);
+    s.overflow.clear();
+    for(unsigned int i=0; i<s.actual.size(); i++)
     {
-        for(int j=0; j<partsx; j++)
+        int value=s.actual[i];
+        if (value>CRITICALMINUSONE)
         {
-            if(cell.first< stepx*(j + 1) && stepx*j<=cell.first && cell.second< stepy*(i + 1) && stepy*i<=cell.second)
-            {
-                return i*partsx + j;
-            }
+            s.overflow.push_back(make_pair(int(i),value));
+            value=0;
         }
+        s.cells[i>>2]|=value<<(2*(i&3));
     }
-    return -1;
+    vector<int>().swap(s.actual);
+}
+
+void unpack(subgrid& s)             // Inverse of pack
+{
+    s.actual.resize(s.getsizex()*s.getsizey());
+    for(unsigned int i=0; i<s.actual.size(); i++)
+    {
+        s.actual[i]=(s.cells[i>>2]>>(2*(i&3)))&CRITICALMINUSONE;
+    }
+    for(unsigned int i=0; i<s.overflow.size(); i++)
+    {
+        s.actual[s.overflow[i].first]=s.overflow[i].second;
+    }
+    vector<unsigned char>().swap(s.cells);
+    vector< pair<int,int> >().swap(s.overflow);
 }
 
-int nonzerocount(vector<int> x )   // How many nonzero elements we have in x
+int nonzerocount(const vector<int>& x )   // How many nonzero elements we have in x
 {
     int result=0;
     for(unsigned int i=0;i<x.size();++i)
@@ -265,15 +542,46 @@ pair<int,int> ih(int index)						// Overload of ih to convert from an index to a
 	return make_pair(index/n,index%n);
 }
 
-vector< pair<int,int> > adjacent(const pair<int,int>& current) // Returns the positions of the 4 adjacent cells in our grid
+class square                        // The lattices that topple and relax are compiled for. A cell (x,y) topples at
+{                                   // critical grains, one to each of its degree neighbors (x+dx[p][i],y+dy[p][i]),
+    public:                         // where p is the parity of x+y in the grid if the lattice has 2 parities
+        static constexpr int critical=CRITICAL, degree=4, parities=1;
+        static constexpr int dx[parities][degree]={{-1,0,1,0}};
+        static constexpr int dy[parities][degree]={{0,1,0,-1}};
+};
+
+class triangular                    // Sheared: the diagonal (1,1) is the third axis
 {
-	vector< pair<int,int> > result;
-	result.push_back(current+make_pair(-1,0));
-	result.push_back(current+make_pair(0,1));
-	result.push_back(current+make_pair(1,0));
-	result.push_back(current+make_pair(0,-1));
-	return result;
-}
+    public:
+        static constexpr int critical=6, degree=6, parities=1;
+        static constexpr int dx[parities][degree]={{-1,0,1,0,1,-1}};
+        static constexpr int dy[parities][degree]={{0,1,0,-1,1,-1}};
+};
+
+class hexagonal                     // Honeycomb as a brick wall: the third neighbor is below or above by parity
+{
+    public:
+        static constexpr int critical=3, degree=3, parities=2;
+        static constexpr int dx[parities][degree]={{-1,1,0},{-1,1,0}};
+        static constexpr int dy[parities][degree]={{0,0,1},{0,0,-1}};
+};
+
+class moore                         // The 8 cells around
+{
+    public:
+        static constexpr int critical=8, degree=8, parities=1;
+        static constexpr int dx[parities][degree]={{-1,0,1,0,-1,1,1,-1}};
+        static constexpr int dy[parities][degree]={{0,1,0,-1,1,1,-1,-1}};
+};
+
+constexpr int square::dx[square::parities][square::degree];
+constexpr int square::dy[square::parities][square::degree];
+constexpr int triangular::dx[triangular::parities][triangular::degree];
+constexpr int triangular::dy[triangular::parities][triangular::degree];
+constexpr int hexagonal::dx[hexagonal::parities][hexagonal::degree];
+constexpr int hexagonal::dy[hexagonal::parities][hexagonal::degree];
+constexpr int moore::dx[moore::parities][moore::degree];
+constexpr int moore::dy[moore::parities][moore::degree];
 
 bool issink(const subgrid& s, const pair<int, int>& index) 	// Determines if the cell at index is a sink (not affected by toppling)
 {											// In our case, only cells at the boundary are sinks
@@ -292,91 +600,266 @@ void checkcriticals(subgrid& s)
     }
 }
 
-void relax(subgrid& s)				// Main relaxation function (uses two stacks to keep track of unstable cells in our grid)
+template<class lattice=square>
+void topple(subgrid& s, const pair<int,int>& current, stack< pair<int,int> >& next) // Topples current until it is
+{                                                                                   // stable, all at once, the neighbors
+    int q=s(current)/lattice::critical;                                             // that become unstable are pushed
+    if (q==0)                                                                       // to next (outers and folds are
+        return;                                                                     // only square)
+    s(current)-=lattice::critical*q;
+    if (s.stats)
+        s.stats->toppled(current.first+current.second*s.getsizex(),q);
+    if (s.folded)
+    {
+        int cell=4*(current.first+current.second*s.getsizex());
+        for(int i=0;i<4;++i)
+        {
+            int j=s.folded->receivers[cell+i];
+            if (j<0)
+                continue;
+            int times=s.folded->shares[cell+i]*q;
+            s.actual[j]+=times;
+            if (s.actual[j] >= CRITICAL && s.actual[j]-times < CRITICAL)
+                next.push(make_pair(j%s.getsizex(),j/s.getsizex()));
+        }
+        return;
+    }
+    int p=lattice::parities==1 ? 0 : (current.first+s.getlocationx()+current.second+s.getlocationy())%lattice::parities;
+    for(int i=0;i<lattice::degree;++i)
+    {
+        pair<int,int> neighbor(current.first+lattice::dx[p][i],current.second+lattice::dy[p][i]);
+        if (issink(s,neighbor) && s.stats)
+        {
+            s.stats->boundary=true;
+        }
+        else if (issink(s,neighbor)==false)
+        {
+            switch( s.isboundary(neighbor) )
+            {
+                case 0:
+                    s.outertop[neighbor.first]+=q;
+                    break;
+                case 1:
+                    s.outerright[neighbor.second]+=q;
+                    break;
+                case 2:
+                    s.outerbottom[neighbor.first]+=q;
+                    break;
+                case 3:
+                    s.outerleft[neighbor.second]+=q;
+                    break;
+                case -1:
+                    s(neighbor)+=q;
+                    if (s(neighbor) >= lattice::critical && s(neighbor)-q < lattice::critical)
+                        next.push(neighbor);
+                    break;
+            }
+        }
+    }
+}
+
+int sweep(subgrid& s)               // Topples every unstable cell of s at once, the grains that leave s go to the outers.
+{                                   // Returns how many cells toppled
+    int sx=s.getsizex(), sy=s.getsizey(), row=sx+2;
+    int* h=&s.actual.front();
+    int* q=&s.fires.front()+row+1;  // q[x+y*row] are the topplings of (x,y)
+    int toppled=0;
+    for(int y=0; y<sy; y++)
+    {
+        const int* hrow=h+y*sx;
+        int* qrow=q+y*row;
+        for(int x=0; x<sx; x++)
+        {
+            qrow[x]=hrow[x]/CRITICAL;
+            toppled+=(qrow[x]!=0);
+        }
+    }
+    if (toppled==0)
+        return 0;
+    for(int y=0; y<sy; y++)         // The ring of zeros around q stands for the outers
+    {
+        int* hrow=h+y*sx;
+        const int* qrow=q+y*row;
+        const int* up=qrow-row;
+        const int* down=qrow+row;
+        for(int x=0; x<sx; x++)
+        {
+            hrow[x]+= -CRITICAL*qrow[x] + qrow[x-1] + qrow[x+1] + up[x] + down[x];
+        }
+    }
+    for(int x=0; x<sx && s.neighbortop!=-1; x++)
+        s.outertop[x]+=q[x];
+    for(int x=0; x<sx && s.neighborbottom!=-1; x++)
+        s.outerbottom[x]+=q[x+(sy-1)*row];
+    for(int y=0; y<sy && s.neighborleft!=-1; y++)
+        s.outerleft[y]+=q[y*row];
+    for(int y=0; y<sy && s.neighborright!=-1; y++)
+        s.outerright[y]+=q[sx-1+y*row];
+    return toppled;
+}
+
+void sweeps(subgrid& s)             // Sweeps s while the unstable cells are dense, then leaves the rest to the stacks
 {
-	vector< pair<int,int> > neighbors(CRITICAL);
-	unsigned int i;
+    int area=s.getsizex()*s.getsizey();
+    s.fires.assign((s.getsizex()+2)*(s.getsizey()+2),0);
+    s.unstable1=stack< pair<int,int> >();
+    s.unstable2=stack< pair<int,int> >();
+    while(sweep(s)*SWEEPDENSITY > area)
+    {
+        // Nothing else to do, sweep() did the work
+    }
+    checkcriticals(s);
+}
+
+template<class lattice=square>
+bool dense(const subgrid& s, const stack< pair<int,int> >& unstable) // Never when recording avalanches, sweeps don't,
+{                                                                    // nor on other lattices than the square one or folds
+    return is_same<lattice,square>::value && s.stats==0 && s.folded==0 &&
+           int(unstable.size())*SWEEPDENSITY > s.getsizex()*s.getsizey();
+}
+
+template<class lattice=square>
+void relax(subgrid& s)				// Main relaxation function (uses two stacks to keep track of unstable cells in our grid,
+{                                   // or sweeps when there are many of them)
 	pair<int,int> current;
-	fill(s.outerbottom.begin(),s.outerbottom.end(),0);
-	fill(s.outertop.begin(),s.outertop.end(),0);
-	fill(s.outerleft.begin(),s.outerleft.end(),0);
-	fill(s.outerright.begin(),s.outerright.end(),0);
 	while(!s.unstable1.empty() || !s.unstable2.empty())
 	{
+		if (dense<lattice>(s,s.unstable1))
+			sweeps(s);
+		if (s.stats && !s.unstable1.empty())
+			s.stats->duration++;
 		while(!s.unstable1.empty())
 		{
 			current=s.unstable1.top();
-			while (s(current) >= CRITICAL)
-			{
-				s(current) -= CRITICAL;
-				neighbors = adjacent(current);
-				for(i=0;i<neighbors.size();++i)
-					if (issink(s,neighbors[i])==false)
-					{
-                        switch( s.isboundary(neighbors[i]) )
-                        {
-                            case 0:
-                                s.outertop[neighbors[i].first]+=1;
-                                break;
-                            case 1:
-                                s.outerright[neighbors[i].second]+=1;
-                                break;
-                            case 2:
-                                s.outerbottom[neighbors[i].first]+=1;
-                                break;
-                            case 3:
-                                s.outerleft[neighbors[i].second]+=1;
-                                break;
-                            case -1:
-                                s(neighbors[i])+=1;
-                                if (s(neighbors[i]) >= CRITICAL)
-                                    s.unstable2.push(neighbors[i]);
-                                break;
-                        }
-					}
-			}
+			topple<lattice>(s,current,s.unstable2);
 			s.unstable1.pop();
 		}
+		if (dense<lattice>(s,s.unstable2))
+			sweeps(s);
+		if (s.stats && !s.unstable2.empty())
+			s.stats->duration++;
 		while(!s.unstable2.empty())
 		{
 			current=s.unstable2.top();
-			while (s(current) >= CRITICAL)
-			{
-				s(current) -= CRITICAL;
-				neighbors = adjacent(current);
-				for(i=0;i<neighbors.size();++i)
-					if (issink(s,neighbors[i])==false)
-					{
-					switch( s.isboundary(neighbors[i]) )
-                        {
-                            case 0:
-                                s.outertop[neighbors[i].first]+=1;
-                                break;
-                            case 1:
-                                s.outerright[neighbors[i].second]+=1;
-                                break;
-                            case 2:
-                                s.outerbottom[neighbors[i].first]+=1;
-                                break;
-                            case 3:
-                                s.outerleft[neighbors[i].second]+=1;
-                                break;
-                            case -1:
-                                s(neighbors[i])+=1;
-                                if (s(neighbors[i]) >= CRITICAL)
-                                    s.unstable1.push(neighbors[i]);
-                                break;
-                        }
-					}
-			}
+			topple<lattice>(s,current,s.unstable1);
 			s.unstable2.pop();
 		}
 	}
 }
 
+bool onborder(const subgrid& s, const pair<int,int>& p) // Whether p is in the first or last row or column of s
+{
+    return p.first==0 || p.second==0 || p.first==s.getsizex()-1 || p.second==s.getsizey()-1;
+}
+
+void relaxborder(subgrid& s)        // Relaxes only the unstable cells of the border of s, so that the outers are complete
+{                                   // for now; the inner cells that are or become unstable are left in s.unstable1 for relax
+    stack< pair<int,int> > border, next;
+    pair<int,int> current;
+    next.swap(s.unstable1);
+    while(!next.empty())
+    {
+        if (onborder(s,next.top()))
+            border.push(next.top());
+        else
+            s.unstable1.push(next.top());
+        next.pop();
+    }
+    while(!border.empty())
+    {
+        current=border.top();
+        border.pop();
+        topple(s,current,next);
+        while(!next.empty())
+        {
+            if (onborder(s,next.top()))
+                border.push(next.top());
+            else
+                s.unstable1.push(next.top());
+            next.pop();
+        }
+    }
+}
+
 void sanitycheck(int argc, char **argv)
 {
-    int world_size;
+    vector<char *> args(1, argv[0]);            // argv without the options
+    overlap=false;
+    ghost=0;
+    packed=false;
+    counterrng=false;
+    avalanches=false;
+    ensemble=false;
+    sourcegrains=0;
+    symmetric=false;
+    latticetype=LATTICESQUARE;
+#ifdef NOMPI
+    threads=max(1u,thread::hardware_concurrency());
+#else
+    threads=0;
+#endif
+    for (int a=1; a<argc; ++a)
+    {
+        if (string(argv[a])=="--overlap")
+        {
+            overlap=true;
+        }
+        else if (string(argv[a])=="--ghost" && a+1<argc)
+        {
+            ghost=atoi(argv[++a]);
+        }
+        else if (string(argv[a])=="--packed")
+        {
+            packed=true;
+        }
+        else if (string(argv[a])=="--counterrng")
+        {
+            counterrng=true;
+        }
+        else if (string(argv[a])=="--avalanches")
+        {
+            avalanches=true;
+        }
+        else if (string(argv[a])=="--ensemble")
+        {
+            ensemble=true;
+        }
+        else if (string(argv[a])=="--source" && a+1<argc)
+        {
+            sourcegrains=atoll(argv[++a]);
+        }
+        else if (string(argv[a])=="--symmetric")
+        {
+            symmetric=true;
+        }
+        else if (string(argv[a])=="--lattice" && a+1<argc)
+        {
+            string name(argv[++a]);
+            if (name=="square")
+                latticetype=LATTICESQUARE;
+            else if (name=="triangular")
+                latticetype=LATTICETRIANGULAR;
+            else if (name=="hexagonal")
+                latticetype=LATTICEHEXAGONAL;
+            else if (name=="moore")
+                latticetype=LATTICEMOORE;
+            else
+            {
+                cout<<"Fatal error. Unknown lattice "<<name<<", use square, triangular, hexagonal or moore."<<endl;
+                exit(-1);
+            }
+        }
+        else if (string(argv[a])=="--threads" && a+1<argc)
+        {
+            threads=max(1,atoi(argv[++a]));
+        }
+        else
+        {
+            args.push_back(argv[a]);
+        }
+    }
+    argc=args.size();
+    argv=&args.front();
     if (argc>1)
     {
         if (argc==7)
@@ -384,8 +867,9 @@ void sanitycheck(int argc, char **argv)
             m=atoi(argv[1]);
             n=atoi(argv[2]);
             nunstable=atoi(argv[3]);
+            seed=atoi(argv[4]);
             mt19937 tempmt(atoi(argv[4]));
-            uniform_int_distribution<int> tempdist2(1,m-2), tempdist1(1,n-2);
+            uniform_int_distribution<int> tempdist1(1,m-2), tempdist2(1,n-2);   // x and y of the points
             mt=tempmt;
             dist1=tempdist1;
             dist2=tempdist2;
@@ -403,28 +887,78 @@ void sanitycheck(int argc, char **argv)
         m=100;      // Default grid size. m is size in x and n is size in y
         n=100;
         nunstable=150;  // Default number of critical cells
+        seed=2;
         mt19937 tempmt(2);
-        uniform_int_distribution<int> tempdist2(1,m-2), tempdist1(1,n-2);
+        uniform_int_distribution<int> tempdist1(1,m-2), tempdist2(1,n-2);   // x and y of the points
         mt=tempmt;
         dist1=tempdist1;
         dist2=tempdist2;
         partsx=1;    // Default number of parts (no divisions)
         partsy=1;
     }
+#ifdef NOMPI
+    world_size=1;
+#else
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+#endif
     if(m%partsx!=0 || n%partsy!=0)
     {
         cout<<"Fatal error. Length of side of grid not divisible by number of parts."<<endl;
         exit(-1);
     }
-    if(world_size!=partsx*partsy)
+    if(threads>0 && !avalanches && sourcegrains==0 && (world_size!=1 || ghost>0 || overlap))
+    {
+        cout<<"Fatal error. --threads runs all the parts in a single process, without --ghost or --overlap."<<endl;
+        exit(-1);
+    }
+    if(avalanches && !ensemble && world_size!=1)
+    {
+        cout<<"Fatal error. --avalanches runs in a single process, unless with --ensemble."<<endl;
+        exit(-1);
+    }
+    if(sourcegrains<0 || (sourcegrains>0 && (world_size!=1 || avalanches)))
     {
-        cout<<"Fatal error. Not enough processes for all parts, or not enough parts for all processes. "<<endl;
-        cout<<"Check that number of processes is equal to partsx*partsy."<<endl;
+        cout<<"Fatal error. --source runs in a single process, without --avalanches."<<endl;
+        exit(-1);
+    }
+    if(symmetric && sourcegrains==0 && (world_size!=1 || avalanches))
+    {
+        cout<<"Fatal error. --symmetric runs in a single process, without --avalanches."<<endl;
+        exit(-1);
+    }
+    if(latticetype!=LATTICESQUARE && !avalanches)
+    {
+        cout<<"Fatal error. --lattice needs --avalanches."<<endl;
+        exit(-1);
+    }
+    if(ensemble && !avalanches)
+    {
+        cout<<"Fatal error. --ensemble needs --avalanches."<<endl;
+        exit(-1);
+    }
+    if(threads==0 && !avalanches && sourcegrains==0 && world_size>partsx*partsy)
+    {
+        cout<<"Fatal error. Not enough parts for all processes. "<<endl;
+        cout<<"Check that number of processes is at most partsx*partsy."<<endl;
+        exit(-1);
+    }
+    if(threads==0 && world_size<partsx*partsy && (ghost>0 || overlap))
+    {
+        cout<<"Fatal error. --ghost and --overlap need one part per process."<<endl;
         exit(-1);
     }
     stepx=m/partsx;
     stepy=n/partsy;
+    if(packed && threads==0 && world_size==partsx*partsy)
+    {
+        cout<<"Fatal error. --packed needs --threads or more parts than processes."<<endl;
+        exit(-1);
+    }
+    if(ghost<0 || ghost>stepx || ghost>stepy || (ghost>0 && overlap))
+    {
+        cout<<"Fatal error. The ghost depth must be at most the size of the subgrids, and can't be used with --overlap."<<endl;
+        exit(-1);
+    }
 }
 
 void init(subgrid& s)
@@ -447,60 +981,201 @@ void init(subgrid& s)
             s(initialunstable[j])=CRITICAL;
         }
     }
-    allneighborsbottom.resize(partsx*partsy);
-    allneighborstop.resize(partsx*partsy);
-    allneighborsleft.resize(partsx*partsy);
-    allneighborsright.resize(partsx*partsy);
-    for( int i=0; i < partsx*partsy; ++i)
-    {
-        if (i%partsx < partsx - 1)
-        {
-            allneighborsright[i] = i + 1;
-        }
-        else
-        {
-            allneighborsright[i] = -1;
-        }
-        if (i%partsx >= 1)
+}
+
+unsigned long long mix(unsigned long long z)     // The splitmix64 finalizer
+{
+    z+=0x9e3779b97f4a7c15ULL;
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    return z^(z>>31);
+}
+
+class streamrng                     // Counter based generator: the numbers of the stream key are hashes of (seed, key,
+{                                   // counter), so that any stream can be drawn without drawing the others
+    public:
+        typedef unsigned long long result_type;
+        streamrng(unsigned long long k) : key(k), counter(0) {};
+        static result_type min() { return 0; }
+        static result_type max() { return ~0ULL; }
+        result_type operator()() { return mix(mix(seed^mix(key))+counter++); }
+        unsigned long long key, counter;
+};
+
+void drawregion(long long k, int x0, int x1, int y0, int y1, unsigned long long node, long long first,
+                int tx0, int tx1, int ty0, int ty1)
+{                                   // Draws the k points of the region [x0,x1)x[y0,y1), numbered from first, that fall in
+    if (k==0 || x1<=tx0 || tx1<=x0 || y1<=ty0 || ty1<=y0) // [tx0,tx1)x[ty0,ty1). The region is halved along its
+        return;                                           // longer side and the points split with a binomial drawn
+    if (x1-x0==1 && y1-y0==1)                             // from the stream node, the halves are the nodes 2*node
+    {                                                     // and 2*node+1
+        for (long long j=0; j<k; ++j)
         {
-            allneighborsleft[i] = i - 1;
+            initialunstable.push_back(make_pair(x0,y0));
+            initialunstableindices.push_back(first+j);
         }
-        else
+        return;
+    }
+    streamrng rng(node);
+    if (x1-x0>=y1-y0)
+    {
+        int xm=x0+(x1-x0)/2;
+        long long left=binomial_distribution<long long>(k,double(xm-x0)/(x1-x0))(rng);
+        drawregion(left,x0,xm,y0,y1,2*node,first,tx0,tx1,ty0,ty1);
+        drawregion(k-left,xm,x1,y0,y1,2*node+1,first+left,tx0,tx1,ty0,ty1);
+    }
+    else
+    {
+        int ym=y0+(y1-y0)/2;
+        long long left=binomial_distribution<long long>(k,double(ym-y0)/(y1-y0))(rng);
+        drawregion(left,x0,x1,y0,ym,2*node,first,tx0,tx1,ty0,ty1);
+        drawregion(k-left,x0,x1,ym,y1,2*node+1,first+left,tx0,tx1,ty0,ty1);
+    }
+}
+
+void drawpoints(int tx0, int tx1, int ty0, int ty1) // Appends the initial points in [tx0,tx1)x[ty0,ty1) with --counterrng.
+{                                                   // They are spread over the same cells as with mt, and the same seed
+    unsigned int start=initialunstable.size();      // gives the same points whatever the parts
+    drawregion(nunstable,1,m-1,1,n-1,1,0,tx0,tx1,ty0,ty1);
+    for (unsigned int i=start; i<initialunstable.size(); ++i)
+    {
+        initialunstablesubgrids.push_back(whichsubgrid(initialunstable[i]));
+    }
+}
+
+void writepacked(const vector< vector<unsigned char> >& cells) // writeout for packed tiles (cells[g] are the cells of
+{                                                               // the tile g), one row of the file at a time, so that
+    string path("./grid.dat");                                  // there is never a full grid of ints
+    ofstream output(path.c_str(), ios::out | ofstream::binary);
+    output.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    output.write(reinterpret_cast<const char *>(&nunstable), sizeof(nunstable));
+    vector<int> row(n);
+    for (int x=0; x<m; ++x)
+    {
+        for (int y=0; y<n; ++y)
         {
-            allneighborsleft[i] = -1;
+            int i=(x%stepx) + (y%stepy)*stepx;
+            row[y]=(cells[whichsubgrid(make_pair(x,y))][i>>2]>>(2*(i&3)))&CRITICALMINUSONE;
         }
-        if (i/partsx < partsy - 1)
+        output.write(reinterpret_cast<const char *>(&row.front()), n*sizeof(int));
+    }
+    for (unsigned int i=0;i<initialunstable.size();++i)
+    {
+        output.write(reinterpret_cast<const char *>(&initialunstable[i].first),sizeof(initialunstable[i].first));
+        output.write(reinterpret_cast<const char *>(&initialunstable[i].second),sizeof(initialunstable[i].second));
+    }
+}
+
+int cell(const subgrid& s, int i)   // The value of the cell i of s, packed or not
+{
+    if (s.actual.empty())
+    {
+        return (s.cells[i>>2]>>(2*(i&3)))&CRITICALMINUSONE;
+    }
+    return s.actual[i];
+}
+
+#ifndef NOMPI
+void writecollective(const vector<subgrid*>& mine) // Every process writes its tiles (mine) straight to their place in
+{                                                  // grid.dat: n, nunstable, the m*n cells with (x,y) at x*n+y, and the
+    MPI_File file;                                 // initial points
+    MPI_File_open(MPI_COMM_WORLD,"./grid.dat",MPI_MODE_CREATE | MPI_MODE_WRONLY,MPI_INFO_NULL,&file);
+    MPI_File_set_size(file,0);
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Offset pointsat=(2+MPI_Offset(m)*n)*sizeof(int);
+    if (world_rank==MASTERPROCESS)
+    {
+        int header[2]={n,nunstable};
+        MPI_File_write_at(file,0,header,2,MPI_INT,MPI_STATUS_IGNORE);
+    }
+    if (counterrng)                 // Everybody writes its own points to their places in the list
+    {
+        vector< pair<long long,int> > order;
+        for (unsigned int i=0;i<initialunstable.size();++i)
         {
-            allneighborsbottom[i] = i + partsx;
+            order.push_back(make_pair(initialunstableindices[i],i));
         }
-        else
+        sort(order.begin(),order.end());
+        vector<int> points;
+        vector<MPI_Aint> places;
+        for (unsigned int i=0;i<order.size();++i)
         {
-            allneighborsbottom[i] = -1;
+            points.push_back(initialunstable[order[i].second].first);
+            points.push_back(initialunstable[order[i].second].second);
+            places.push_back(order[i].first*2*sizeof(int));
         }
-        if (i/partsx >= 1)
+        MPI_Datatype mine;
+        MPI_Type_create_hindexed_block(places.size(),2,places.empty() ? 0 : &places.front(),MPI_INT,&mine);
+        MPI_Type_commit(&mine);
+        MPI_File_set_view(file,pointsat,MPI_INT,mine,"native",MPI_INFO_NULL);
+        MPI_File_write_all(file,points.empty() ? 0 : &points.front(),points.size(),MPI_INT,MPI_STATUS_IGNORE);
+        MPI_Type_free(&mine);
+    }
+    else if (world_rank==MASTERPROCESS)
+    {
+        vector<int> points;
+        for (unsigned int i=0;i<initialunstable.size();++i)
         {
-            allneighborstop[i] = i - partsx;
+            points.push_back(initialunstable[i].first);
+            points.push_back(initialunstable[i].second);
         }
-        else
+        if (!points.empty())
+            MPI_File_write_at(file,pointsat,&points.front(),points.size(),MPI_INT,MPI_STATUS_IGNORE);
+    }
+    int count=mine.size(), rounds;
+    MPI_Allreduce(&count,&rounds,1,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+    vector<int> buffer(stepx*stepy);
+    int sizes[2]={m,n}, subsizes[2]={stepx,stepy};
+    for (int k=0; k<rounds; ++k)    // One tile of each process at a time, the processes with fewer tiles write nothing
+    {
+        int starts[2]={0,0}, length=0;
+        if (k<count)
         {
-            allneighborstop[i] = -1;
+            const subgrid& s=*mine[k];
+            starts[0]=s.getlocationx();
+            starts[1]=s.getlocationy();
+            for (int x=0; x<stepx; ++x)
+            {
+                for (int y=0; y<stepy; ++y)
+                {
+                    buffer[x*stepy+y]=cell(s,x+y*stepx);
+                }
+            }
+            length=buffer.size();
         }
+        MPI_Datatype tile;
+        MPI_Type_create_subarray(2,sizes,subsizes,starts,MPI_ORDER_C,MPI_INT,&tile);
+        MPI_Type_commit(&tile);
+        MPI_File_set_view(file,2*sizeof(int),MPI_INT,tile,"native",MPI_INFO_NULL);
+        MPI_File_write_all(file,&buffer.front(),length,MPI_INT,MPI_STATUS_IGNORE);
+        MPI_Type_free(&tile);
     }
-    allouterbottom.resize(partsx*partsy);
-    alloutertop.resize(partsx*partsy);
-    allouterleft.resize(partsx*partsy);
-    allouterright.resize(partsx*partsy);
-    for( int i=0; i< partsx*partsy; ++i)
+    MPI_File_close(&file);
+}
+#endif
+
+vector< vector<int> > pointsbytile() // The initial points of each tile, as indices in initialunstable
+{
+    vector< vector<int> > points(partsx*partsy);
+    for (unsigned int j=0; j < initialunstable.size(); ++j)
     {
-        allouterbottom[i].resize(stepx);
-        alloutertop[i].resize(stepx);
-        allouterleft[i].resize(stepy);
-        allouterright[i].resize(stepy);
+        points[initialunstablesubgrids[j]].push_back(j);
     }
+    return points;
 }
 
-void addsubgridtototal(subgrid& total, const vector<int>& sub, const int lx, const int ly)
-{
+void filltile(subgrid& s, int g, const vector<int>& points) // Makes s the tile g with its initial points, and pushes
+{                                                           // them to s.unstable1
+    s=subgrid(g,(g%partsx)*stepx,int(g/partsx)*stepy,stepx,stepy,CRITICALMINUSONE);
+    for (unsigned int j=0; j < points.size(); ++j)
+    {
+        s(initialunstable[points[j]].first-s.getlocationx(),initialunstable[points[j]].second-s.getlocationy())=CRITICAL;
+    }
+    checkcriticals(s);
+}
+
+void addsubgridtototal(subgrid& total, const vector<int>& sub, const int lx, const int ly) // total is n by m, so that the
+{                                                                                          // cell (x,y) is at x*n+y
     for(int i=0;i<stepy;++i)
     {
         for(int j=0;j<stepx;++j)
@@ -528,135 +1203,235 @@ void writeout(const subgrid& s)
 	}
 }
 
-void receiveallouters()
+int pendingwork(const subgrid& s)  // How many outers of s still have grains, plus one if it has unstable cells left
 {
-    for (int i=1;i<partsx*partsy;++i)   // This is the only part where the sizes being equal for all subgrids matter
+    return   nonzerocount(s.outertop)
+            +nonzerocount(s.outerbottom)
+            +nonzerocount(s.outerleft)
+            +nonzerocount(s.outerright)
+            +(s.unstable1.empty() && s.unstable2.empty() ? 0 : 1);
+}
+
+#ifndef NOMPI
+void postouter(vector<int>& outer, vector<int>& send, vector<int>& inner, int neighbor, int sendtag, int receivetag,
+               MPI_Request& receive, MPI_Request& send_request)
+{                                   // Posts the transfers with the neighbor on side. An outer without grains goes as
+    receive=MPI_REQUEST_NULL;       // an empty message, so that the neighbor knows it without a collective
+    send_request=MPI_REQUEST_NULL;
+    if (neighbor==-1)
+        return;
+    int count=0;
+    if (nonzerocount(outer)!=0)
     {
-        if (allneighborsbottom[i]!=-1)
-        {
-            MPI_Recv(&(allouterbottom[i].front()),allouterbottom[i].size(),MPI_INT,i,MPI_ANY_TAG,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        }
-        if (allneighborstop[i]!=-1)
-        {
-            MPI_Recv(&(alloutertop[i].front()),alloutertop[i].size(),MPI_INT,i,MPI_ANY_TAG,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        }
-        if (allneighborsleft[i]!=-1)
-        {
-            MPI_Recv(&(allouterleft[i].front()),allouterleft[i].size(),MPI_INT,i,MPI_ANY_TAG,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        }
-        if (allneighborsright[i]!=-1)
-        {
-            MPI_Recv(&(allouterright[i].front()),allouterright[i].size(),MPI_INT,i,MPI_ANY_TAG,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        }
+        swap(outer,send);
+        fill(outer.begin(),outer.end(),0);
+        count=send.size();
     }
+    MPI_Isend(&(send.front()),count,MPI_INT,neighbor,sendtag,MPI_COMM_WORLD,&send_request);
+    MPI_Irecv(&(inner.front()),inner.size(),MPI_INT,neighbor,receivetag,MPI_COMM_WORLD,&receive);
 }
 
-void sendallouterstoadd()
-{
-    for (int i=1;i<partsx*partsy;++i)   // This is the only part where the sizes being equal for all subgrids matter
+void postouters(subgrid& s, MPI_Request* receives, MPI_Request* sends) // Moves the outers with grains to the send
+{                                   // buffers and posts the transfers with the four neighbors; the requests are in the
+                                    // order top, bottom, left, right, MPI_REQUEST_NULL if there is no neighbor there
+    postouter(s.outertop,s.sendtop,s.innertop,s.neighbortop,TAGUP,TAGDOWN,receives[0],sends[0]);
+    postouter(s.outerbottom,s.sendbottom,s.innerbottom,s.neighborbottom,TAGDOWN,TAGUP,receives[1],sends[1]);
+    postouter(s.outerleft,s.sendleft,s.innerleft,s.neighborleft,TAGLEFT,TAGRIGHT,receives[2],sends[2]);
+    postouter(s.outerright,s.sendright,s.innerright,s.neighborright,TAGRIGHT,TAGLEFT,receives[3],sends[3]);
+}
+#endif
+
+template<class lattice=square>
+void addgrains(subgrid& s, int x, int y, int grains) // Adds grains to the cell (x,y), pushing it to s.unstable1 if it
+{                                                    // becomes unstable
+    if (grains!=0)
     {
-        if (allneighborsbottom[i]!=-1)
-        {
-            MPI_Send(&(alloutertop[allneighborsbottom[i]].front()),alloutertop[allneighborsbottom[i]].size(),MPI_INT,i,0,MPI_COMM_WORLD);
-        }
-        if (allneighborstop[i]!=-1)
-        {
-            MPI_Send(&(allouterbottom[allneighborstop[i]].front()),allouterbottom[allneighborstop[i]].size(),MPI_INT,i,0,MPI_COMM_WORLD);
-        }
-        if (allneighborsleft[i]!=-1)
-        {
-            MPI_Send(&(allouterright[allneighborsleft[i]].front()),allouterright[allneighborsleft[i]].size(),MPI_INT,i,0,MPI_COMM_WORLD);
-        }
-        if (allneighborsright[i]!=-1)
-        {
-            MPI_Send(&(allouterleft[allneighborsright[i]].front()),allouterleft[allneighborsright[i]].size(),MPI_INT,i,0,MPI_COMM_WORLD);
-        }
+        s(x,y)+=grains;
+        if (s(x,y)>=lattice::critical && s(x,y)-grains<lattice::critical)
+            s.unstable1.push(make_pair(x,y));
     }
 }
 
+void addinner(subgrid& s, int side)     // Adds the grains received from the neighbor on side (0 top, 1 bottom, 2 left,
+{                                       // 3 right) to our cells on that side
+    switch(side)
+    {
+        case 0:
+            for(int i=0; i<s.getsizex();++i)
+            {
+                addgrains(s,i,0,s.innertop[i]);
+            }
+            break;
+        case 1:
+            for(int i=0; i<s.getsizex();++i)
+            {
+                addgrains(s,i,s.getsizey()-1,s.innerbottom[i]);
+            }
+            break;
+        case 2:
+            for(int i=0; i<s.getsizey();++i)
+            {
+                addgrains(s,0,i,s.innerleft[i]);
+            }
+            break;
+        case 3:
+            for(int i=0; i<s.getsizey();++i)
+            {
+                addgrains(s,s.getsizex()-1,i,s.innerright[i]);
+            }
+            break;
+    }
+}
 
-void receiveouterstoaddfrommaster(subgrid &s)
-{
-    vector<int> tempouterbottom(s.outerbottom.size(),0);
-    vector<int> tempoutertop(s.outertop.size(),0);
-    vector<int> tempouterleft(s.outerleft.size(),0);
-    vector<int> tempouterright(s.outerright.size(),0);
-    if (s.neighborbottom!=-1)
+#ifndef NOMPI
+void completeouters(subgrid& s, MPI_Request* receives, MPI_Request* sends) // Adds each side as soon as it arrives,
+{                                                                           // the empty ones carry no grains
+    int side, count;
+    MPI_Status status;
+    MPI_Waitany(4,receives,&side,&status);
+    while (side!=MPI_UNDEFINED)
     {
-        MPI_Recv(&(tempouterbottom.front()),tempouterbottom.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        for(unsigned int i=0; i< tempouterbottom.size();++i)
-        {
-            s(i,stepy-1)+=tempouterbottom[i];
-        }
+        MPI_Get_count(&status,MPI_INT,&count);
+        if (count>0)
+            addinner(s,side);
+        MPI_Waitany(4,receives,&side,&status);
     }
-    if (s.neighbortop!=-1)
+    MPI_Waitall(4,sends,MPI_STATUSES_IGNORE);
+}
+#endif
+
+void fillghosted(subgrid& s)        // Copies our cells to the middle of s.ghosted, the ghost zones start empty
+{
+    int k=ghost;
+    int row=s.getsizex()+2*k;
+    s.ghosted.assign(row*(s.getsizey()+2*k),0);
+    s.fires.assign(s.ghosted.size(),0);
+    for(int j=0; j<s.getsizey(); j++)
     {
-        MPI_Recv(&(tempoutertop.front()),tempoutertop.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        for(unsigned int i=0; i< tempoutertop.size();++i)
+        for(int i=0; i<s.getsizex(); i++)
         {
-            s(i,0)+=tempoutertop[i];
+            s.ghosted[(i+k) + (j+k)*row]=s(i,j);
         }
     }
-    if (s.neighborleft!=-1)
+}
+
+void unfillghosted(subgrid& s)      // Copies our cells back from s.ghosted
+{
+    int k=ghost;
+    int row=s.getsizex()+2*k;
+    for(int j=0; j<s.getsizey(); j++)
     {
-        MPI_Recv(&(tempouterleft.front()),tempouterleft.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        for(unsigned int i=0; i< tempouterleft.size();++i)
+        for(int i=0; i<s.getsizex(); i++)
         {
-            s(0,i)+=tempouterleft[i];
+            s(i,j)=s.ghosted[(i+k) + (j+k)*row];
         }
     }
-    if (s.neighborright!=-1)
+}
+
+void packghosts(const subgrid& s, int i0, int i1, int j0, int j1, vector<int>& buffer) // Copies the block
+{                                                                                     // [i0,i1)x[j0,j1) of s.ghosted
+    int row=s.getsizex()+2*ghost;
+    buffer.clear();
+    for(int j=j0; j<j1; j++)
     {
-        MPI_Recv(&(tempouterright.front()),tempouterright.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        for(unsigned int i=0; i< tempouterright.size();++i)
-        {
-            s(stepx-1,i)+=tempouterright[i];
-        }
+        buffer.insert(buffer.end(),s.ghosted.begin()+i0+j*row,s.ghosted.begin()+i1+j*row);
     }
 }
 
-void sendouterstomaster(subgrid& s) // The master process should receive these in the same order!
+void unpackghosts(subgrid& s, int i0, int i1, int j0, int j1, const vector<int>& buffer)
 {
-    if (s.neighborbottom!=-1)
+    int row=s.getsizex()+2*ghost;
+    for(int j=j0; j<j1; j++)
     {
-        MPI_Send(&(s.outerbottom.front()),s.outerbottom.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD);
+        copy(buffer.begin()+(j-j0)*(i1-i0),buffer.begin()+(j-j0+1)*(i1-i0),s.ghosted.begin()+i0+j*row);
     }
-    if (s.neighbortop!=-1)
+}
+
+#ifndef NOMPI
+void exchangeghosts(subgrid& s)     // Refreshes the ghost zones with the current values of the neighbors: first the
+{                                   // columns, then the rows, which then carry the corners of the diagonal neighbors
+    int k=ghost;
+    int sx=s.getsizex(), sy=s.getsizey();
+    vector<int> outleft, outright, inleft(k*sy), inright(k*sy);
+    MPI_Request requests[4];
+    for (int r=0; r<4; ++r)
     {
-        MPI_Send(&(s.outertop.front()),s.outertop.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD);
+        requests[r]=MPI_REQUEST_NULL;
     }
     if (s.neighborleft!=-1)
     {
-        MPI_Send(&(s.outerleft.front()),s.outerleft.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD);
+        packghosts(s,k,2*k,k,k+sy,outleft);
+        MPI_Irecv(&(inleft.front()),inleft.size(),MPI_INT,s.neighborleft,TAGRIGHT,MPI_COMM_WORLD,&requests[0]);
+        MPI_Isend(&(outleft.front()),outleft.size(),MPI_INT,s.neighborleft,TAGLEFT,MPI_COMM_WORLD,&requests[1]);
     }
     if (s.neighborright!=-1)
     {
-        MPI_Send(&(s.outerright.front()),s.outerright.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD);
+        packghosts(s,sx,sx+k,k,k+sy,outright);
+        MPI_Irecv(&(inright.front()),inright.size(),MPI_INT,s.neighborright,TAGLEFT,MPI_COMM_WORLD,&requests[2]);
+        MPI_Isend(&(outright.front()),outright.size(),MPI_INT,s.neighborright,TAGRIGHT,MPI_COMM_WORLD,&requests[3]);
     }
+    MPI_Waitall(4,requests,MPI_STATUSES_IGNORE);
+    if (s.neighborleft!=-1)
+        unpackghosts(s,0,k,k,k+sy,inleft);
+    if (s.neighborright!=-1)
+        unpackghosts(s,sx+k,sx+2*k,k,k+sy,inright);
+    vector<int> outtop, outbottom, intop(k*(sx+2*k)), inbottom(k*(sx+2*k));
+    for (int r=0; r<4; ++r)
+    {
+        requests[r]=MPI_REQUEST_NULL;
+    }
+    if (s.neighbortop!=-1)
+    {
+        packghosts(s,0,sx+2*k,k,2*k,outtop);
+        MPI_Irecv(&(intop.front()),intop.size(),MPI_INT,s.neighbortop,TAGDOWN,MPI_COMM_WORLD,&requests[0]);
+        MPI_Isend(&(outtop.front()),outtop.size(),MPI_INT,s.neighbortop,TAGUP,MPI_COMM_WORLD,&requests[1]);
+    }
+    if (s.neighborbottom!=-1)
+    {
+        packghosts(s,0,sx+2*k,sy,sy+k,outbottom);
+        MPI_Irecv(&(inbottom.front()),inbottom.size(),MPI_INT,s.neighborbottom,TAGUP,MPI_COMM_WORLD,&requests[2]);
+        MPI_Isend(&(outbottom.front()),outbottom.size(),MPI_INT,s.neighborbottom,TAGDOWN,MPI_COMM_WORLD,&requests[3]);
+    }
+    MPI_Waitall(4,requests,MPI_STATUSES_IGNORE);
+    if (s.neighbortop!=-1)
+        unpackghosts(s,0,sx+2*k,0,k,intop);
+    if (s.neighborbottom!=-1)
+        unpackghosts(s,0,sx+2*k,sy+k,sy+2*k,inbottom);
 }
+#endif
 
-
-void addoutersinmaster(subgrid& s)
-{
-    if (s.neighborbottom!=-1)
+bool ghostsweeps(subgrid& s)        // Topples every unstable cell of s.ghosted at once, ghost times. Each sweep leaves
+{                                   // one more ring of the ghost zones out of date, so after the last one exactly our
+    int k=ghost;                    // cells are right. Returns whether anything toppled
+    int row=s.getsizex()+2*k;
+    int height=s.getsizey()+2*k;
+    int ilo=max(0,k-s.getlocationx()), ihi=min(row,k+m-s.getlocationx());       // Cells inside the grid, the rest
+    int jlo=max(0,k-s.getlocationy()), jhi=min(height,k+n-s.getlocationy());    // are sinks and never fire
+    bool toppled=false;
+    for(int t=1; t<=k; t++)
     {
-        vector<int> tempouterbottom=alloutertop[s.neighborbottom];
-        for(unsigned int i=0; i< tempouterbottom.size();++i)
+        for(int j=max(jlo,t-1); j<min(jhi,height-t+1); j++)
         {
-            s(i,stepy-1)+=tempouterbottom[i];
+            for(int i=max(ilo,t-1); i<min(ihi,row-t+1); i++)
+            {
+                int f=s.ghosted[i+j*row]/CRITICAL;
+                s.fires[i+j*row]=f;
+                toppled|=(f!=0);
+            }
         }
-    }
-    if (s.neighborright!=-1)
-    {
-        vector<int> tempouterright=allouterleft[s.neighborright];
-        for(unsigned int i=0; i< tempouterright.size();++i)
+        for(int j=max(jlo,t); j<min(jhi,height-t); j++)
         {
-            s(stepx-1,i)+=tempouterright[i];
+            for(int i=max(ilo,t); i<min(ihi,row-t); i++)
+            {
+                int c=i+j*row;
+                s.ghosted[c]+= -CRITICAL*s.fires[c] + s.fires[c-1] + s.fires[c+1] + s.fires[c-row] + s.fires[c+row];
+            }
         }
     }
-
+    return toppled;
 }
 
+#ifndef NOMPI
 void waitformaster()
 {
     int a;
@@ -674,6 +1449,7 @@ void masterdone()
     }
 
 }
+#endif
 
 void debug_messages(int messagenumber, int showmessages)
 {
@@ -687,15 +1463,9 @@ void debug_messages(int messagenumber, int showmessages)
             case 4: cout<<world_rank<<": Checking criticals."<<endl;break;
             case 5: cout<<world_rank<<": Relaxing..."<<endl;break;
             case 6: cout<<world_rank<<": Relaxed."<<endl; break;
-            case 7: cout<<"MASTER: Receiving pending counts."<<endl; break;
-            case 8: cout<<"MASTER: Done receiving pending counts."<<endl; break;
-            case 9: cout<<"MASTER: Done adding outers."<<endl; break;
-            case 10: cout<<"MASTER: Done receiving all outers."<<endl; break;
-            case 11: cout<<"MASTER: Done sending all outers to add to slaves."<<endl; break;
-            case 12: cout<<world_rank<<": Receiving outers to add."<<endl;break;
-            case 13: cout<<world_rank<<": Done receiving outers to add."<<endl;break;
-            case 14: cout<<world_rank<<": Sending outers to master."<<endl;break;
-            case 15: cout<<world_rank<<": Done sending outers to master."<<endl;break;
+            case 7: cout<<world_rank<<": Exchanging outers with the neighbors."<<endl; break;
+            case 8: cout<<world_rank<<": Done exchanging outers."<<endl; break;
+            case 9: cout<<world_rank<<": Done reducing pending counts."<<endl; break;
         }
     }
 }
@@ -711,26 +1481,988 @@ void debug_messages(int messagenumber, int showmessages, int process)
     }
 }
 
-//============================================================================
-// TODO: Implement parameter parsing
-//
-//============================================================================
-int main(int argc, char **argv) {
+class tilepool                      // Work stealing queues of the tiles for the threaded backend, one per thread
+{
+    public:
+        tilepool(int ntiles, int nthreads);
+        vector< deque<int> > queues;    // Each thread takes from the back of its queue and steals from the front of others
+        vector<mutex> queuelocks;
+        vector<mutex> tilelocks;        // Protect the inners and the state of each tile
+        vector<int> state;
+        atomic<int> pending;            // Tiles queued or being relaxed; the run is over when it gets to 0
+        void push(int worker, int tile);
+        bool pop(int worker, int& tile);
+};
+
+tilepool::tilepool(int ntiles, int nthreads) : queues(nthreads), queuelocks(nthreads), tilelocks(ntiles), state(ntiles,TILEIDLE)
+{
+    pending=0;
+}
+
+void tilepool::push(int worker, int tile)
+{
+    lock_guard<mutex> guard(queuelocks[worker]);
+    queues[worker].push_back(tile);
+}
+
+bool tilepool::pop(int worker, int& tile)
+{
+    for(unsigned int i=0; i<queues.size(); i++)
+    {
+        int victim=(worker+i)%queues.size();
+        lock_guard<mutex> guard(queuelocks[victim]);
+        if (!queues[victim].empty())
+        {
+            if (i==0)
+            {
+                tile=queues[victim].back();
+                queues[victim].pop_back();
+            }
+            else
+            {
+                tile=queues[victim].front();
+                queues[victim].pop_front();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void deliver(tilepool& pool, int worker, vector<int>& outer, int neighbor, vector<int>& inner)
+{                                   // Adds the grains of outer to the inner of the tile neighbor, and queues it if idle
+    if (neighbor==-1 || nonzerocount(outer)==0)
+        return;
+    {
+        lock_guard<mutex> guard(pool.tilelocks[neighbor]);
+        for(unsigned int i=0; i<outer.size(); i++)
+        {
+            inner[i]+=outer[i];
+        }
+        if (pool.state[neighbor]==TILEIDLE)
+        {
+            pool.state[neighbor]=TILEQUEUED;
+            pool.pending++;
+            pool.push(worker,neighbor);
+        }
+        else if (pool.state[neighbor]==TILERUNNING)
+        {
+            pool.state[neighbor]=TILEDIRTY;
+        }
+    }
+    fill(outer.begin(),outer.end(),0);
+}
+
+void relaxtile(vector<subgrid>& tiles, tilepool& pool, int worker, int g) // Takes the grains sent to tile g, relaxes it
+{                                                                       // and sends its outers to the neighbor tiles
+    subgrid& s=tiles[g];
+    if (packed)
+        unpack(s);
+    {
+        lock_guard<mutex> guard(pool.tilelocks[g]);
+        pool.state[g]=TILERUNNING;
+        for(int side=0; side<4; side++)
+        {
+            addinner(s,side);
+        }
+        fill(s.innertop.begin(),s.innertop.end(),0);
+        fill(s.innerbottom.begin(),s.innerbottom.end(),0);
+        fill(s.innerleft.begin(),s.innerleft.end(),0);
+        fill(s.innerright.begin(),s.innerright.end(),0);
+    }
+    relax(s);
+    deliver(pool,worker,s.outertop,s.neighbortop,tiles[max(s.neighbortop,0)].innerbottom);
+    deliver(pool,worker,s.outerbottom,s.neighborbottom,tiles[max(s.neighborbottom,0)].innertop);
+    deliver(pool,worker,s.outerleft,s.neighborleft,tiles[max(s.neighborleft,0)].innerright);
+    deliver(pool,worker,s.outerright,s.neighborright,tiles[max(s.neighborright,0)].innerleft);
+    if (packed)
+        pack(s);
+    lock_guard<mutex> guard(pool.tilelocks[g]);
+    if (pool.state[g]==TILEDIRTY)      // Grains arrived while we were relaxing, we go again
+    {
+        pool.state[g]=TILEQUEUED;
+        pool.push(worker,g);
+    }
+    else
+    {
+        pool.state[g]=TILEIDLE;
+        pool.pending--;
+    }
+}
+
+void runthreads()                   // All the subgrids in one process, relaxed by a pool of threads that pass the
+{                                   // grains through the inners of the tiles
+    int ntiles=partsx*partsy;
+    vector<subgrid> tiles(ntiles);
+    if (counterrng)
+    {
+        drawpoints(0,m,0,n);
+    }
+    else
+    {
+        subgrid scratch(MASTERPROCESS,0,0,stepx,stepy,0);
+        init(scratch);              // Draws the initial points
+    }
+    vector< vector<int> > points=pointsbytile();
+    tilepool pool(ntiles,threads);
+    for(int g=0; g<ntiles; g++)
+    {
+        filltile(tiles[g],g,points[g]);
+        if (!tiles[g].unstable1.empty())
+        {
+            pool.state[g]=TILEQUEUED;
+            pool.pending++;
+            pool.push(g%threads,g);
+        }
+        if (packed)
+            pack(tiles[g]);
+    }
+    auto worker = [&](int w)
+    {
+        int g;
+        while (pool.pending>0)
+        {
+            if (pool.pop(w,g))
+                relaxtile(tiles,pool,w,g);
+            else
+                this_thread::yield();
+        }
+    };
+    vector<thread> workers;
+    for (int i = 1; i < threads; ++i)
+    {
+        workers.push_back(thread(worker,i));
+    }
+    worker(0);
+    for (unsigned int i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+    if (packed)
+    {
+        vector< vector<unsigned char> > cells(ntiles);
+        for(int g=0; g<ntiles; g++)
+        {
+            cells[g].swap(tiles[g].cells);
+        }
+        writepacked(cells);
+        return;
+    }
+    subgrid total(MASTERPROCESS,0,0,n,m,0);
+    for(int g=0; g<ntiles; g++)
+    {
+        addsubgridtototal(total,tiles[g].actual,tiles[g].getlocationx(),tiles[g].getlocationy());
+    }
+    writeout(total);
+}
+
+vector<int>& inner(subgrid& s, int side)    // The inner of s on side (0 top, 1 bottom, 2 left, 3 right)
+{
+    switch(side)
+    {
+        case 0: return s.innertop;
+        case 1: return s.innerbottom;
+        case 2: return s.innerleft;
+        default: return s.innerright;
+    }
+}
+
+template<class lattice>
+long long dropgrains(mt19937& rng, loghistogram& sizes, loghistogram& volumes, ofstream* output)
+{                                   // Drops nunstable grains one at a time on random cells of a stable grid, as full as it
+    subgrid s(MASTERPROCESS,0,0,m,n,lattice::critical-1); // can be, relaxing after each one, and records the avalanche of
+    avalanchestats stats(m*n);                            // every grain. Returns the number of grains that toppled nothing
+    s.stats=&stats;
+    uniform_int_distribution<int> dropx(0,m-1), dropy(0,n-1);
+    long long quiet=0;
+    for (int k=0; k<nunstable; ++k)
+    {
+        stats.start();
+        int x=dropx(rng);
+        int y=dropy(rng);
+        addgrains<lattice>(s,x,y,1);
+        relax<lattice>(s);
+        if (output)
+        {
+            int record[4]={stats.size,int(stats.volume),stats.duration,stats.boundary ? -1 : 1};
+            output->write(reinterpret_cast<const char *>(record), sizeof(record));
+        }
+        if (stats.size==0)
+        {
+            ++quiet;
+            continue;
+        }
+        sizes.add(stats.size);
+        volumes.add(stats.volume);
+    }
+    return quiet;
+}
+
+long long dropgrains(mt19937& rng, loghistogram& sizes, loghistogram& volumes, ofstream* output) // On the lattice of
+{                                                                                                 // --lattice
+    switch (latticetype)
+    {
+        case LATTICETRIANGULAR:
+            return dropgrains<triangular>(rng,sizes,volumes,output);
+        case LATTICEHEXAGONAL:
+            return dropgrains<hexagonal>(rng,sizes,volumes,output);
+        case LATTICEMOORE:
+            return dropgrains<moore>(rng,sizes,volumes,output);
+        default:
+            return dropgrains<square>(rng,sizes,volumes,output);
+    }
+}
+
+string avalanchename()              // Start of the names of the avalanche files, the lattice is in them unless it's square
+{
+    static const char* lattices[4]={"","_triangular","_hexagonal","_moore"};
+    return "./classical_sandpile/avalanches"+to_string(m)+"_"+to_string(n)+"_"+to_string(nunstable)+"_"+to_string(seed)
+           +lattices[latticetype];
+}
+
+#ifndef NOMPI
+void reducehistogram(loghistogram& h)  // Sums the histograms of all the processes in the one of the master
+{
+    int bins=h.counts.size();
+    MPI_Allreduce(MPI_IN_PLACE, &bins, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    h.counts.resize(bins,0);
+    if (world_rank==MASTERPROCESS)
+    {
+        MPI_Reduce(MPI_IN_PLACE, &h.counts.front(), bins, MPI_LONG_LONG, MPI_SUM, MASTERPROCESS, MPI_COMM_WORLD);
+        MPI_Reduce(MPI_IN_PLACE, &h.total, 1, MPI_LONG_LONG, MPI_SUM, MASTERPROCESS, MPI_COMM_WORLD);
+    }
+    else
+    {
+        MPI_Reduce(&h.counts.front(), 0, bins, MPI_LONG_LONG, MPI_SUM, MASTERPROCESS, MPI_COMM_WORLD);
+        MPI_Reduce(&h.total, 0, 1, MPI_LONG_LONG, MPI_SUM, MASTERPROCESS, MPI_COMM_WORLD);
+    }
+}
+#endif
+
+void runensemble()                  // Every thread of every process drops nunstable grains on its own grid, with its own
+{                                   // stream of drops, and only the sum of all the histograms is written
+    int members=max(threads,1);
+    long long runs=(long long)members*world_size;
+    string name(avalanchename()+"_x"+to_string(runs));
+    if (world_rank==MASTERPROCESS && !ofstream((name+"sizes.txt").c_str(), ios::out ))
+    {
+        cout<<"Fatal error. Cannot write "<<name<<"sizes.txt, does ./classical_sandpile exist?"<<endl;
+        exit(-1);
+    }
+    vector<loghistogram> sizes(members), volumes(members);
+    vector<long long> quiet(members);
+    auto member = [&](int t)
+    {
+        seed_seq seq{(unsigned int)seed, (unsigned int)(world_rank*members+t)};
+        mt19937 rng(seq);
+        quiet[t]=dropgrains(rng,sizes[t],volumes[t],0);
+    };
+    vector<thread> workers;
+    for (int i = 1; i < members; ++i)
+    {
+        workers.push_back(thread(member,i));
+    }
+    member(0);
+    for (unsigned int i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+    for (int t = 1; t < members; ++t)
+    {
+        sizes[0].add(sizes[t]);
+        volumes[0].add(volumes[t]);
+        quiet[0]+=quiet[t];
+    }
+#ifndef NOMPI
+    reducehistogram(sizes[0]);
+    reducehistogram(volumes[0]);
+    MPI_Allreduce(MPI_IN_PLACE, &quiet[0], 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+    if (world_rank==MASTERPROCESS)
+    {
+        sizes[0].write(name+"sizes.txt");
+        volumes[0].write(name+"volumes.txt");
+        cout<<"runs: "<<runs<<", grains dropped: "<<runs*nunstable<<", without avalanche: "<<quiet[0]<<endl;
+    }
+}
+
+void runavalanches()                // A single run of dropgrains, with every avalanche written as it happens
+{
+    string name(avalanchename());
+    ofstream output((name+".bin").c_str(), ios::out | ofstream::binary);
+    if (!output)
+    {
+        cout<<"Fatal error. Cannot write "<<name<<".bin, does ./classical_sandpile exist?"<<endl;
+        exit(-1);
+    }
+    int header[4]={m,n,nunstable,int(seed)};
+    output.write(reinterpret_cast<const char *>(header), sizeof(header));
+    loghistogram sizes, volumes;
+    long long quiet=dropgrains(mt,sizes,volumes,&output);
+    output.close();
+    sizes.write(name+"sizes.txt");
+    volumes.write(name+"volumes.txt");
+    cout<<"grains dropped: "<<nunstable<<", without avalanche: "<<quiet<<endl;
+}
+
+void smoothodometer(vector<double>& u, const fold& f, const vector< pair<int,double> >& sources, double threshold,
+                    int sweeps)     // Projected SOR sweeps for the divisible sandpile on the cells of f with the grains of
+{                                   // sources (sorted by cell): u>=0, and grains+Laplacian of u is threshold where u>0 and
+    static const int dx[4]={-1,0,1,0};  // at most threshold elsewhere
+    static const int dy[4]={0,1,0,-1};
+    for (int k=0; k<sweeps; ++k)
+    {
+        unsigned int next=0;
+        for (int y=0; y<f.sizey; ++y)
+        {
+            for (int x=0; x<f.sizex; ++x)
+            {
+                if (!f.inside(x,y))
+                    continue;
+                int i=x+y*f.sizex;
+                double around=0;
+                for (int d=0; d<4; ++d)
+                {
+                    int j=f.rep(x+dx[d],y+dy[d]);
+                    if (j>=0)
+                        around+=u[j];
+                }
+                if (next<sources.size() && sources[next].first==i)
+                    around+=sources[next++].second;
+                u[i]=max(0.0,u[i]+OVERRELAXATION*((around-threshold)/4-u[i]));
+            }
+        }
+    }
+}
+
+void convergeodometer(vector<double>& u, const fold& f, const vector< pair<int,double> >& sources, double threshold,
+                      double tolerance) // smoothodometer until the sweeps change u by less than tolerance per
+{                                           // cell (by less than 1e-9 of the total if tolerance is 0)
+    double before, after=accumulate(u.begin(),u.end(),0.0);
+    do
+    {
+        before=after;
+        smoothodometer(u,f,sources,threshold,LEVELSWEEPS);
+        after=accumulate(u.begin(),u.end(),0.0);
+    }
+    while (fabs(after-before)>(tolerance>0 ? tolerance*f.sizex*f.sizey : 1e-9*after));
+}
+
+vector<double> approximateodometer(const fold& f, const vector< pair<int,double> >& sources, double threshold,
+                                   double tolerance)
+{                                   // The odometer of the divisible sandpile on the cells of f, for the grains of sources
+    vector<double> u(f.sizex*f.sizey,0); // (sorted cells of the full grid). It is solved on the full grid of half the
+    vector< pair<int,double> > folded;   // side (where a cell holds 4 cells, so 4 times the threshold), interpolated and
+    for (unsigned int k=0; k<sources.size(); ++k)  // smoothed until it converges. The grains go to the coarse grid
+    {                                              // with the weights of the interpolation, so that they stay
+        int x=sources[k].first%f.fullx-f.x0;       // centered where they are
+        int y=sources[k].first/f.fullx-f.y0;
+        if (f.inside(x,y))
+            folded.push_back(make_pair(x+y*f.sizex,sources[k].second));
+    }
+    if (max(f.fullx,f.fully)<=COARSESTSIDE)
+    {
+        convergeodometer(u,f,folded,threshold,0);
+        return u;
+    }
+    fold coarsegrid((f.fullx+1)/2,(f.fully+1)/2);
+    int cx=coarsegrid.sizex, cy=coarsegrid.sizey;
+    vector< pair<int,double> > coarsesources;
+    for (unsigned int k=0; k<sources.size(); ++k)
+    {
+        int x=sources[k].first%f.fullx, y=sources[k].first/f.fullx;
+        for (int c=0; c<4; ++c)     // Fine x is at (x-0.5)/2 in the coarse grid: 3/4 of it goes to the coarse cell
+        {                           // that holds it, 1/4 to the next one on the side of x
+            int ci=(c&1) ? (x%2==0 ? x/2-1 : x/2+1) : x/2;
+            int cj=(c>>1) ? (y%2==0 ? y/2-1 : y/2+1) : y/2;
+            double weight=((c&1) ? 0.25 : 0.75)*((c>>1) ? 0.25 : 0.75);
+            if (ci>=0 && ci<cx && cj>=0 && cj<cy)
+                coarsesources.push_back(make_pair(ci+cj*cx,weight*sources[k].second));
+        }
+    }
+    sort(coarsesources.begin(),coarsesources.end());
+    unsigned int merged=0;
+    for (unsigned int k=0; k<coarsesources.size(); ++k)
+    {
+        if (merged>0 && coarsesources[merged-1].first==coarsesources[k].first)
+            coarsesources[merged-1].second+=coarsesources[k].second;
+        else
+            coarsesources[merged++]=coarsesources[k];
+    }
+    coarsesources.resize(merged);
+    vector<double> coarse=approximateodometer(coarsegrid,coarsesources,4*threshold,tolerance);
+    for (int y=0; y<f.sizey; ++y)
+    {
+        double b=(f.y0+y-0.5)/2;    // The cell (x,y) is at (a,b) in the coarse grid, outside of which u is 0
+        int j=int(floor(b));
+        double t=b-j;
+        for (int x=0; x<f.sizex; ++x)
+        {
+            if (!f.inside(x,y))
+                continue;
+            double a=(f.x0+x-0.5)/2;
+            int i=int(floor(a));
+            double r=a-i;
+            double corner[4]={0,0,0,0};
+            for (int c=0; c<4; ++c)
+            {
+                int ci=i+(c&1), cj=j+(c>>1);
+                if (ci>=0 && ci<cx && cj>=0 && cj<cy)
+                    corner[c]=coarse[ci+cj*cx];
+            }
+            u[x+y*f.sizex]=(1-t)*((1-r)*corner[0]+r*corner[1])+t*((1-r)*corner[2]+r*corner[3]);
+        }
+    }
+    vector<double>().swap(coarse);
+    convergeodometer(u,f,folded,threshold,tolerance);
+    return u;
+}
+
+void untopplecells(subgrid& s, vector<long long>& u, stack<int>& negative) // Untopples the cells of negative (with
+{                                                    // u>0 and a negative height) as many times as they stay stable,
+    const fold& f=*s.folded;                         // and the neighbors that become negative after them. s is all the
+                                                     // cells of s.folded
+    while (!negative.empty())
+    {
+        int i=negative.top();
+        negative.pop();
+        int q=int(min(u[i],(long long)(CRITICALMINUSONE-s.actual[i])/CRITICAL));
+        if (q<=0)
+            continue;
+        u[i]-=q;
+        s.actual[i]+=CRITICAL*q;
+        for (int d=0; d<4; ++d)
+        {
+            int j=f.receivers[4*i+d];
+            if (j<0)
+                continue;
+            int times=f.shares[4*i+d]*q;
+            s.actual[j]-=times;
+            if (s.actual[j]<0 && s.actual[j]+times>=0 && u[j]>0)
+                negative.push(j);
+        }
+    }
+}
+
+bool untoppleset(subgrid& s, vector<long long>& u, vector<int>& candidates, vector<char>& inside, vector<char>& around,
+                 stack<int>& negative)  // Dhar's burning among candidates (all the cells with u>0 if there are none):
+{                                       // finds the largest set of them that can all untopple at once and stay stable
+    static const int dx[4]={-1,0,1,0};  // (every cell has fewer grains than neighbors in the set), and untopples it as
+    static const int dy[4]={0,1,0,-1};  // many times as it stays so. candidates becomes the set, false if it is empty,
+    const fold& f=*s.folded;            // and the neighbors that become negative go to negative. inside and around are
+    int sx=f.sizex;                     // all 0 before and after. s is all the cells of s.folded
+    if (candidates.empty())
+    {
+        for (int i=0; i<sx*f.sizey; ++i)
+        {
+            if (u[i]>0)
+                candidates.push_back(i);
+        }
+    }
+    for (unsigned int k=0; k<candidates.size(); ++k)
+        inside[candidates[k]]=(u[candidates[k]]>0);
+    stack<int> burning;
+    for (unsigned int k=0; k<candidates.size(); ++k)
+    {
+        int i=candidates[k];
+        if (!inside[i])
+            continue;
+        for (int d=0; d<4; ++d)
+        {
+            int j=f.rep(i%sx+dx[d],i/sx+dy[d]);
+            if (j>=0 && inside[j])
+                ++around[i];
+        }
+        if (s.actual[i]>=around[i])
+            burning.push(i);
+    }
+    while (!burning.empty())
+    {
+        int i=burning.top();
+        burning.pop();
+        if (!inside[i])
+            continue;
+        inside[i]=0;
+        for (int d=0; d<4; ++d)
+        {
+            int j=f.receivers[4*i+d];
+            if (j>=0 && inside[j] && s.actual[j]>=(around[j]-=f.shares[4*i+d]))
+                burning.push(j);
+        }
+    }
+    long long times=HIGHHEIGHT/CRITICAL;    // So that the heights stay in the ints of s
+    unsigned int kept=0;
+    for (unsigned int k=0; k<candidates.size(); ++k)
+    {
+        int i=candidates[k];
+        if (inside[i])
+        {
+            candidates[kept++]=i;
+            times=min(times,u[i]);
+            if (around[i]<CRITICAL)
+                times=min(times,(long long)(CRITICALMINUSONE-s.actual[i])/(CRITICAL-around[i]));
+        }
+        inside[i]=0;
+        around[i]=0;
+    }
+    candidates.resize(kept);
+    if (kept==0)
+        return false;
+    int q=int(times);
+    for (unsigned int k=0; k<kept; ++k)
+    {
+        int i=candidates[k];
+        u[i]-=q;
+        s.actual[i]+=CRITICAL*q;
+        for (int d=0; d<4; ++d)
+        {
+            int j=f.receivers[4*i+d];
+            if (j<0)
+                continue;
+            int sent=f.shares[4*i+d]*q;
+            s.actual[j]-=sent;
+            if (s.actual[j]<0 && s.actual[j]+sent>=0 && u[j]>0)
+                negative.push(j);
+        }
+    }
+    return true;
+}
+
+void bringinrange(vector<long long>& height, vector<long long>& u, const fold& f, bool low) // Untopples (low) the
+{                                                   // cells of f that toppled and are at or below -HIGHHEIGHT, or
+    stack<int> far;                                 // topples the cells at or above HIGHHEIGHT, and the neighbors that
+                                                    // get there after them, so that the heights fit in the ints of a
+                                                    // subgrid
+    for (int i=0; i<f.sizex*f.sizey; ++i)
+    {
+        if (low ? height[i]<=-HIGHHEIGHT && u[i]>0 : height[i]>=HIGHHEIGHT)
+            far.push(i);
+    }
+    while (!far.empty())
+    {
+        int i=far.top();
+        far.pop();
+        long long q=low ? -min(u[i],-height[i]/CRITICAL) : height[i]/CRITICAL;
+        height[i]-=CRITICAL*q;
+        u[i]+=q;
+        for (int d=0; d<4; ++d)
+        {
+            int j=f.receivers[4*i+d];
+            if (j<0)
+                continue;
+            int times=f.shares[4*i+d];
+            height[j]+=times*q;
+            if (low ? height[j]<=-HIGHHEIGHT && height[j]-times*q>-HIGHHEIGHT && u[j]>0
+                    : height[j]>=HIGHHEIGHT && height[j]-times*q<HIGHHEIGHT)
+                far.push(j);
+        }
+    }
+}
+
+void runsource()                    // Stabilizes sourcegrains grains at the center of an empty grid: applies at once the
+{                                   // rounded odometer of the divisible sandpile, topples what is left unstable (in 64
+    fold f(m,n);                    // bits the cells too high for relax, then with relax), and untopples what was
+    int px=m/2, py=n/2;             // toppled too much. By the least action principle the result is the same as toppling
+    if (symmetric)                  // the grains one by one. With symmetric only the cells of f are simulated
+        f.symmetrize(vector< pair<int,int> >(1,make_pair(px,py)));
+    f.tabulate();
+    int cells=f.sizex*f.sizey;
+    vector<long long> u(cells);
+    {
+        vector<double> approximate=approximateodometer(f,vector< pair<int,double> >(1,make_pair(px+py*m,double(sourcegrains))),
+                                                       SOURCEDENSITY,double(m)*n/ODOMETERSLACK);
+        for (int i=0; i<cells; ++i)
+            u[i]=(long long)floor(approximate[i]);
+    }
+    vector<long long> height(cells,0);
+    height[f.rep(px-f.x0,py-f.y0)]=sourcegrains;
+    for (int i=0; i<cells; ++i)
+    {
+        height[i]-=CRITICAL*u[i];
+        for (int d=0; d<4; ++d)
+        {
+            if (f.receivers[4*i+d]>=0)
+                height[f.receivers[4*i+d]]+=f.shares[4*i+d]*u[i];
+        }
+    }
+    bringinrange(height,u,f,true);
+    bringinrange(height,u,f,false);
+    subgrid s(MASTERPROCESS,0,0,f.sizex,f.sizey,0);
+    s.folded=&f;
+    for (int i=0; i<cells; ++i)
+        s.actual[i]=int(height[i]);
+    vector<long long>().swap(height);
+    avalanchestats stats(cells);
+    stats.odometer.swap(u);
+    s.stats=&stats;
+    stats.start();
+    checkcriticals(s);
+    relax(s);
+    vector<int> candidates;         // The last set untoppled, where the next one is looked for first: the sets only
+    vector<char> inside(cells,0);   // shrink, and the whole domain is searched only when nothing is found there
+    vector<char> around(cells,0);
+    stack<int> negative;
+    for (int i=0; i<cells; ++i)
+    {
+        if (stats.odometer[i]>0 && s.actual[i]<0)
+            negative.push(i);
+    }
+    untopplecells(s,stats.odometer,negative);
+    int rounds=0, searches=0;
+    while (true)
+    {
+        bool everywhere=candidates.empty();
+        searches+=everywhere;
+        if (untoppleset(s,stats.odometer,candidates,inside,around,negative))
+        {
+            ++rounds;
+            untopplecells(s,stats.odometer,negative);
+        }
+        else if (everywhere)
+        {
+            break;
+        }
+    }
+    nunstable=1;
+    initialunstable.assign(1,make_pair(px,py));
+    subgrid total(MASTERPROCESS,0,0,n,m,0);
+    for (int y=0; y<n; ++y)
+    {
+        for (int x=0; x<m; ++x)
+        {
+            total(y,x)=s.actual[f.rep(x-f.x0,y-f.y0)];
+        }
+    }
+    writeout(total);
+    cout<<"cells simulated: "<<f.sizex<<"x"<<f.sizey<<(f.diagonal ? " (on and under the diagonal)" : "")
+        <<", topplings left to relax: "<<stats.volume<<", untoppled by sets "<<rounds<<" times ("<<searches<<" searches of all the cells)"<<endl;
+}
+
+void runsymmetric()                 // Places every initial point together with its mirror images in the grid, so that the
+{                                   // placement has all the symmetries of the grid, and relaxes only the cells of the fold
+    fold f(m,n);                    // that the placement leaves in place. The grains are added all at once, so the final
+    f.symmetrize(vector< pair<int,int> >()); // state has the same symmetries (abelian property)
+    if (counterrng)
+    {
+        drawpoints(0,m,0,n);
+    }
+    else
+    {
+        subgrid scratch(MASTERPROCESS,0,0,stepx,stepy,0);
+        init(scratch);              // Draws the initial points
+    }
+    vector<char> drawn(f.sizex*f.sizey,0);
+    for (unsigned int j=0; j<initialunstable.size(); ++j)
+        drawn[f.rep(initialunstable[j].first-f.x0,initialunstable[j].second-f.y0)]=1;
+    initialunstable.clear();
+    for (int x=0; x<m; ++x)
+    {
+        for (int y=0; y<n; ++y)
+        {
+            if (drawn[f.rep(x-f.x0,y-f.y0)])
+                initialunstable.push_back(make_pair(x,y));
+        }
+    }
+    nunstable=initialunstable.size();
+    f.symmetrize(initialunstable);
+    f.tabulate();
+    subgrid s(MASTERPROCESS,0,0,f.sizex,f.sizey,CRITICALMINUSONE);
+    s.folded=&f;
+    for (unsigned int j=0; j<initialunstable.size(); ++j)
+        s.actual[f.rep(initialunstable[j].first-f.x0,initialunstable[j].second-f.y0)]=CRITICAL;
+    checkcriticals(s);
+    relax(s);
+    subgrid total(MASTERPROCESS,0,0,n,m,0);
+    for (int y=0; y<n; ++y)
+    {
+        for (int x=0; x<m; ++x)
+        {
+            total(y,x)=s.actual[f.rep(x-f.x0,y-f.y0)];
+        }
+    }
+    writeout(total);
+    cout<<"cells simulated: "<<f.sizex<<"x"<<f.sizey<<(f.diagonal ? " (on and under the diagonal)" : "")
+        <<", initial points with their images: "<<nunstable<<endl;
+}
+
+#ifndef NOMPI
+class tilemap                       // The tiles of a process when there are more tiles than processes. Every process
+{                                   // knows the owner of every tile, but only the tiles it owns are allocated
+    public:
+        tilemap(int ntiles);
+        vector<subgrid> tiles;
+        vector<int> owner;
+        vector<int> active;         // Our tiles with grains to take or unstable cells, to be relaxed in the next round
+        vector<char> isactive;
+        vector< vector<int> > outbox;   // Grains for the tiles of each process, as tile, side of the inner, values
+        void activate(int g);
+        void send(vector<int>& outer, int neighbor, int side);
+};
+
+tilemap::tilemap(int ntiles) : tiles(ntiles), owner(ntiles), isactive(ntiles,0), outbox(world_size)
+{
+    for(int g=0; g<ntiles; g++)
+    {
+        owner[g]=g%world_size;      // Round robin, so that nearby tiles are on different processes
+    }
+}
+
+void tilemap::activate(int g)
+{
+    if (!isactive[g])
+    {
+        isactive[g]=1;
+        active.push_back(g);
+    }
+}
+
+void tilemap::send(vector<int>& outer, int neighbor, int side) // Hands the grains of outer to the inner on side of
+{                                                               // the tile neighbor, directly if it is ours
+    if (neighbor==-1 || nonzerocount(outer)==0)
+        return;
+    if (owner[neighbor]==world_rank)
+    {
+        vector<int>& target=inner(tiles[neighbor],side);
+        for(unsigned int i=0; i<outer.size(); i++)
+        {
+            target[i]+=outer[i];
+        }
+        activate(neighbor);
+    }
+    else
+    {
+        vector<int>& box=outbox[owner[neighbor]];
+        box.push_back(neighbor);
+        box.push_back(side);
+        box.insert(box.end(),outer.begin(),outer.end());
+    }
+    fill(outer.begin(),outer.end(),0);
+}
+
+void relaxactive(tilemap& t)        // Relaxes the active tiles, the tiles they send grains to are active next round
+{
+    vector<int> current;
+    current.swap(t.active);
+    for(unsigned int k=0; k<current.size(); k++)
+    {
+        t.isactive[current[k]]=0;
+    }
+    for(unsigned int k=0; k<current.size(); k++)
+    {
+        subgrid& s=t.tiles[current[k]];
+        if (packed)
+            unpack(s);
+        for(int side=0; side<4; side++)
+        {
+            addinner(s,side);
+            fill(inner(s,side).begin(),inner(s,side).end(),0);
+        }
+        relax(s);
+        t.send(s.outertop,s.neighbortop,1);
+        t.send(s.outerbottom,s.neighborbottom,0);
+        t.send(s.outerleft,s.neighborleft,3);
+        t.send(s.outerright,s.neighborright,2);
+        if (packed)
+            pack(s);
+    }
+}
+
+void exchangetiles(tilemap& t)      // Sends the outboxes to their processes and adds what we get to our tiles
+{
+    vector<int> sendcounts(world_size), recvcounts(world_size), senddispls(world_size,0), recvdispls(world_size,0);
+    vector<int> sendbuffer;
+    for(int r=0; r<world_size; r++)
+    {
+        sendcounts[r]=t.outbox[r].size();
+        senddispls[r]=sendbuffer.size();
+        sendbuffer.insert(sendbuffer.end(),t.outbox[r].begin(),t.outbox[r].end());
+        t.outbox[r].clear();
+    }
+    MPI_Alltoall(&sendcounts.front(),1,MPI_INT,&recvcounts.front(),1,MPI_INT,MPI_COMM_WORLD);
+    for(int r=1; r<world_size; r++)
+    {
+        recvdispls[r]=recvdispls[r-1]+recvcounts[r-1];
+    }
+    vector<int> recvbuffer(recvdispls[world_size-1]+recvcounts[world_size-1]+1);
+    sendbuffer.push_back(0);        // So that front() is valid when there is nothing to send
+    MPI_Alltoallv(&sendbuffer.front(),&sendcounts.front(),&senddispls.front(),MPI_INT,
+                  &recvbuffer.front(),&recvcounts.front(),&recvdispls.front(),MPI_INT,MPI_COMM_WORLD);
+    unsigned int k=0;
+    while(k+1<recvbuffer.size())
+    {
+        int g=recvbuffer[k];
+        vector<int>& target=inner(t.tiles[g],recvbuffer[k+1]);
+        for(unsigned int i=0; i<target.size(); i++)
+        {
+            target[i]+=recvbuffer[k+2+i];
+        }
+        t.activate(g);
+        k+=2+target.size();
+    }
+}
+
+void balancetiles(tilemap& t)       // Moves active tiles from the busiest processes to the idlest ones until they
+{                                   // differ by at most one active tile. Every process makes the same plan
+    int count=t.active.size();
+    vector<int> counts(world_size), displs(world_size,0);
+    MPI_Allgather(&count,1,MPI_INT,&counts.front(),1,MPI_INT,MPI_COMM_WORLD);
+    if (*max_element(counts.begin(),counts.end()) - *min_element(counts.begin(),counts.end()) <= 1)
+        return;
+    for(int r=1; r<world_size; r++)
+    {
+        displs[r]=displs[r-1]+counts[r-1];
+    }
+    vector<int> all(displs[world_size-1]+counts[world_size-1]);
+    t.active.push_back(0);          // So that front() is valid when we have no active tiles
+    MPI_Allgatherv(&t.active.front(),count,MPI_INT,&all.front(),&counts.front(),&displs.front(),MPI_INT,MPI_COMM_WORLD);
+    t.active.pop_back();
+    vector< vector<int> > lists(world_size);
+    for(int r=0; r<world_size; r++)
+    {
+        lists[r].assign(all.begin()+displs[r],all.begin()+displs[r]+counts[r]);
+    }
+    vector<int> moves;              // Tile, from, to
+    while(true)
+    {
+        int busiest=max_element(counts.begin(),counts.end())-counts.begin();
+        int idlest=min_element(counts.begin(),counts.end())-counts.begin();
+        if (counts[busiest]-counts[idlest]<=1)
+            break;
+        int g=lists[busiest].back();
+        lists[busiest].pop_back();
+        lists[idlest].push_back(g);
+        counts[busiest]--;
+        counts[idlest]++;
+        moves.push_back(g);
+        moves.push_back(busiest);
+        moves.push_back(idlest);
+    }
+    int tilesize=stepx*stepy+2*stepx+2*stepy;       // actual and the four inners
+    vector< vector<int> > buffers(moves.size()/3);
+    vector<MPI_Request> requests;
+    for(unsigned int k=0; k<moves.size(); k+=3)
+    {
+        int g=moves[k];
+        vector<int>& buffer=buffers[k/3];
+        if (moves[k+1]==world_rank)
+        {
+            subgrid& s=t.tiles[g];
+            if (packed)
+                unpack(s);
+            buffer=s.actual;
+            for(int side=0; side<4; side++)
+            {
+                buffer.insert(buffer.end(),inner(s,side).begin(),inner(s,side).end());
+            }
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Isend(&buffer.front(),tilesize,MPI_INT,moves[k+2],TAGMOVE,MPI_COMM_WORLD,&requests.back());
+        }
+        else if (moves[k+2]==world_rank)
+        {
+            buffer.resize(tilesize);
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Irecv(&buffer.front(),tilesize,MPI_INT,moves[k+1],TAGMOVE,MPI_COMM_WORLD,&requests.back());
+        }
+    }
+    if (!requests.empty())
+        MPI_Waitall(requests.size(),&requests.front(),MPI_STATUSES_IGNORE);
+    for(unsigned int k=0; k<moves.size(); k+=3)
+    {
+        int g=moves[k];
+        t.owner[g]=moves[k+2];
+        if (moves[k+1]==world_rank)
+        {
+            t.tiles[g]=subgrid();
+            t.isactive[g]=0;
+        }
+        else if (moves[k+2]==world_rank)
+        {
+            subgrid& s=t.tiles[g];
+            s=subgrid(g,(g%partsx)*stepx,int(g/partsx)*stepy,stepx,stepy,0);
+            vector<int>& buffer=buffers[k/3];
+            copy(buffer.begin(),buffer.begin()+stepx*stepy,s.actual.begin());
+            int offset=stepx*stepy;
+            for(int side=0; side<4; side++)
+            {
+                copy(buffer.begin()+offset,buffer.begin()+offset+inner(s,side).size(),inner(s,side).begin());
+                offset+=inner(s,side).size();
+            }
+            if (packed)
+                pack(s);
+            t.activate(g);
+        }
+    }
+    t.active=lists[world_rank];
+}
+
+void runtiles()                     // More tiles than processes: each process relaxes only its active tiles, and
+{                                   // active tiles move to the processes with less work
+    tilemap t(partsx*partsy);
+    if (counterrng)                 // Only the points of our tiles
+    {
+        for(int g=world_rank; g<partsx*partsy; g+=world_size)
+        {
+            drawpoints((g%partsx)*stepx,(g%partsx+1)*stepx,int(g/partsx)*stepy,int(g/partsx+1)*stepy);
+        }
+    }
+    else
+    {
+        subgrid scratch(MASTERPROCESS,0,0,stepx,stepy,0);
+        init(scratch);              // Every process draws the same initial points
+    }
+    vector< vector<int> > points=pointsbytile();
+    for(int g=0; g<partsx*partsy; g++)
+    {
+        if (t.owner[g]==world_rank)
+        {
+            filltile(t.tiles[g],g,points[g]);
+            if (!t.tiles[g].unstable1.empty())
+                t.activate(g);
+            if (packed)
+                pack(t.tiles[g]);
+        }
+    }
+    int accum=1;
+    while(accum!=0)
+    {
+        relaxactive(t);
+        exchangetiles(t);
+        int pendingcount=t.active.size();
+        MPI_Allreduce(&pendingcount,&accum,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD); // Active tiles anywhere
+        if (accum!=0)
+            balancetiles(t);
+    }
+    vector<subgrid*> mine;
+    for(int g=0; g<partsx*partsy; g++)
+    {
+        if (t.owner[g]==world_rank)
+            mine.push_back(&t.tiles[g]);
+    }
+    writecollective(mine);
+}
+
+void runmpi()                       // One subgrid per process, the grains cross the borders in messages
+{
     int pendingcount;
     int numberinitialunstable;
     int accum = 1;
     int debugging=0; // Verbosity is OFF by default
     int donemessage=0;
-    MPI_Init(&argc, &argv);
-    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
-    sanitycheck(argc,argv);
     subgrid s(        world_rank,
                                 (world_rank%partsx) * stepx,
                                 int(world_rank/partsx) * stepy,
                                 stepx,
                                 stepy,
                                 CRITICALMINUSONE);
-    if(world_rank == 0)
+    if (counterrng)                 // Every process draws the points of its subgrid
+    {
+        drawpoints(s.getlocationx(),s.getlocationx()+stepx,s.getlocationy(),s.getlocationy()+stepy);
+        for (unsigned int j=0; j < initialunstable.size(); ++j)
+        {
+            s(initialunstable[j].first-s.getlocationx(),initialunstable[j].second-s.getlocationy())=CRITICAL;
+        }
+    }
+    else if(world_rank == 0)
     {
         init(s);
         for (int i=1; i<partsx*partsy; ++i)
@@ -777,87 +2509,92 @@ int main(int argc, char **argv) {
     {
         MPI_Bcast(&donemessage,1,MPI_INT,MASTERPROCESS,MPI_COMM_WORLD);
     }
-    while(accum!=0)
+    if (ghost>0)                        // Sweeps on our cells and the ghost zones, exchanging only every ghost sweeps
     {
-        accum=0;
-        debug_messages(4,debugging);
-        checkcriticals(s);
-        debug_messages(5,debugging);
-        relax(s);
-        debug_messages(6,debugging);
-        if (world_rank==0)
-        {
-			int mypendingcount=nonzerocount(s.outerbottom)
-                            +nonzerocount(s.outertop)
-                            +nonzerocount(s.outerleft)
-                            +nonzerocount(s.outerright);
-            accum += mypendingcount;
-            allouterbottom[MASTERPROCESS]=s.outerbottom;
-            alloutertop[MASTERPROCESS]=s.outertop;
-            allouterleft[MASTERPROCESS]=s.outerleft;
-            allouterright[MASTERPROCESS]=s.outerright;
+        fillghosted(s);
+        exchangeghosts(s);
+        while(accum!=0)
+        {
+            accum=0;
+            debug_messages(5,debugging);
+            pendingcount=ghostsweeps(s);
             debug_messages(7,debugging);
-            for (int i=1;i<partsx*partsy;++i)
-            {
-                MPI_Recv(&pendingcount,1,MPI_INT,i,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-                accum += pendingcount;
-            }
+            exchangeghosts(s);
             debug_messages(8,debugging);
-            receiveallouters();
-            debug_messages(10,debugging);
-            addoutersinmaster(s);
+            MPI_Allreduce(&pendingcount,&accum,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD); // Somebody still toppling
             debug_messages(9,debugging);
-            sendallouterstoadd();
-            debug_messages(11,debugging);
-            for (int i=1;i<partsx*partsy;++i)
-            {
-                MPI_Send(&accum,1,MPI_INT,i,0,MPI_COMM_WORLD);
-            }
         }
-        else
+        unfillghosted(s);
+    }
+    else
+    {
+        debug_messages(4,debugging);
+        checkcriticals(s);              // Only once, afterwards the unstable cells come from the grains we receive
+        while(accum!=0)
         {
-            pendingcount =   nonzerocount(s.outerbottom)
-                            +nonzerocount(s.outertop)
-                            +nonzerocount(s.outerleft)
-                            +nonzerocount(s.outerright) ;
-            MPI_Send(&pendingcount,1,MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD);
-            debug_messages(14,debugging);
-            sendouterstomaster(s);
-            debug_messages(15,debugging);
-            debug_messages(12,debugging);
-            receiveouterstoaddfrommaster(s);
-            debug_messages(13,debugging);
-            MPI_Recv(&accum,1,MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-        }
-    }
-    if (world_rank==0)
-    {
-        subgrid total(  MASTERPROCESS,
-                        0,
-                        0,
-                        m,
-                        n,
-                        0);
-        vector<int> tempactual(stepx*stepy,0);
-        int templx,temply;
-        addsubgridtototal(total,s.actual,s.getlocationx(),s.getlocationy());
-        for (int i=1;i<partsx*partsy;++i)
-        {
-            MPI_Recv(&(tempactual.front()),tempactual.size(),MPI_INT,i,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-            MPI_Recv(&templx,1,MPI_INT,i,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-            MPI_Recv(&temply,1,MPI_INT,i,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-            addsubgridtototal(total,tempactual,templx,temply);
-        }
-        writeout(total);
+            MPI_Request receives[4], sends[4];
+            accum=0;
+            debug_messages(5,debugging);
+            if (overlap)                // Border first, then the interior while the outers travel
+                relaxborder(s);
+            else
+                relax(s);
+            debug_messages(6,debugging);
+            debug_messages(7,debugging);
+            postouters(s,receives,sends);
+            if (overlap)
+                relax(s);
+            completeouters(s,receives,sends);
+            debug_messages(8,debugging);
+            pendingcount=pendingwork(s);
+            MPI_Allreduce(&pendingcount,&accum,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD); // Grains or unstable cells left anywhere
+            debug_messages(9,debugging);
+        }
+    }
+    writecollective(vector<subgrid*>(1,&s));
+}
+#endif
+
+//============================================================================
+// TODO: Implement parameter parsing
+//
+//============================================================================
+int main(int argc, char **argv) {
+#ifndef NOMPI
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+#endif
+    sanitycheck(argc,argv);
+    if (sourcegrains>0)
+    {
+        runsource();
+    }
+    else if (symmetric)
+    {
+        runsymmetric();
+    }
+    else if (ensemble)
+    {
+        runensemble();
+    }
+    else if (avalanches)
+    {
+        runavalanches();
+    }
+    else if (threads>0)
+    {
+        runthreads();
+    }
+#ifndef NOMPI
+    else if (world_size<partsx*partsy)
+    {
+        runtiles();
     }
     else
     {
-        int templx=s.getlocationx();
-        int temply=s.getlocationy();
-        MPI_Send(&(s.actual.front()),s.actual.size(),MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD);
-        MPI_Send(&templx,1,MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD);
-        MPI_Send(&temply,1,MPI_INT,MASTERPROCESS,0,MPI_COMM_WORLD);
+        runmpi();
     }
     MPI_Finalize();
+#endif
     return 0;
 }